@@ -18,30 +18,389 @@
 #include "nsIURI.h"
 #include "nsIDOMDocument.h"
 #include "nsPIDOMWindow.h"
-#include "nsIEmbedLiteJSON.h"
 #include "nsComponentManagerUtils.h"
-#include "nsIVariant.h"
-#include "nsHashPropertyBag.h"
 #include "nsIDOMWindowUtils.h"
 #include "nsIDOMHTMLLinkElement.h"
 #include "nsIFocusManager.h"
 #include "nsIDocShellTreeItem.h"
 #include "nsIWebNavigation.h"
+#include "mozilla/Preferences.h"
+#include "mozilla/StaticPtr.h"
+#include "mozilla/ClearOnShutdown.h"
+#include "mozilla/ArrayUtils.h"
+#include "nsDataHashtable.h"
+#include "nsClassHashtable.h"
+#include "nsCharSeparatedTokenizer.h"
+#include "nsReadableUtils.h"
+#include "nsIDOMElement.h"
+#include "nsHashKeys.h"
+#include "nsIDocument.h"
+#include "nsDOMNavigationTiming.h"
+#include "nsITimedChannel.h"
+#include "prtime.h"
+#include "EmbedJSONWriter.h"
+#include "EmbedJSONMessage.h"
 
-EmbedChromeListener::EmbedChromeListener(nsIDOMWindow* aWin)
+using namespace mozilla;
+
+// Send link and meta events of a document as one chrome:headbatch message
+#define HEADBATCH_PREF "embedlite.chrome.headbatch"
+
+// Longest wait in ms for DOMContentLoaded before queued entries are sent
+#define HEADBATCH_MAX_DELAY 1000
+
+// Idle time in ms after the last entry once the document has loaded
+#define HEADBATCH_IDLE_DELAY 100
+
+static bool sHeadBatch = false;
+
+// Attach navigation timing to chrome:contentloaded
+#define LOADTIMING_PREF "embedlite.chrome.loadtiming"
+
+// Also keep and report rolling load time averages per origin
+#define LOADTIMING_AGGREGATE_PREF "embedlite.chrome.loadtiming.aggregate"
+
+// Weight of the latest load in the per-origin averages
+#define LOADTIMING_AVERAGE_WEIGHT 0.2
+
+// Origins tracked at most, the table starts over when full
+#define LOADTIMING_MAX_ORIGINS 128
+
+static bool sLoadTiming = false;
+static bool sLoadTimingAggregate = false;
+
+// Rolling averages in ms relative to navigation start, each with the
+// number of loads that reported it
+struct OriginTiming
+{
+    OriginTiming()
+      : mLoads(0)
+      , mResponses(0)
+      , mPaints(0)
+      , mResponseEnd(0)
+      , mDomContentLoaded(0)
+      , mFirstPaint(0)
+    {
+    }
+
+    uint32_t mLoads;
+    uint32_t mResponses;
+    uint32_t mPaints;
+    double mResponseEnd;
+    double mDomContentLoaded;
+    double mFirstPaint;
+};
+
+typedef nsClassHashtable<nsCStringHashKey, OriginTiming> OriginTimingTable;
+static StaticAutoPtr<OriginTimingTable> sOriginTimings;
+
+static void
+UpdateAverage(double& aAverage, uint32_t& aSamples, int64_t aValue)
+{
+    if (aSamples++) {
+        aAverage += (double(aValue) - aAverage) * LOADTIMING_AVERAGE_WEIGHT;
+    } else {
+        aAverage = double(aValue);
+    }
+}
+
+static OriginTiming*
+GetOriginTiming(nsIDocument* aDocument)
+{
+    nsIURI* uri = aDocument->GetDocumentURI();
+    nsAutoCString origin;
+    if (!uri || NS_FAILED(uri->GetPrePath(origin))) {
+        return nullptr;
+    }
+
+    if (!sOriginTimings) {
+        sOriginTimings = new OriginTimingTable();
+        ClearOnShutdown(&sOriginTimings);
+    }
+    OriginTiming* timing = sOriginTimings->Get(origin);
+    if (!timing) {
+        if (sOriginTimings->Count() >= LOADTIMING_MAX_ORIGINS) {
+            sOriginTimings->Clear();
+        }
+        timing = new OriginTiming();
+        sOriginTimings->Put(origin, timing);
+    }
+    return timing;
+}
+
+// Navigation start in ms since the epoch, 0 when unknown
+static DOMTimeMilliSec
+GetNavigationStart(nsIDocument* aDocument)
+{
+    nsDOMNavigationTiming* timing = aDocument ? aDocument->GetNavigationTiming() : nullptr;
+    return timing ? timing->GetNavigationStart() : 0;
+}
+
+// Comma separated meta names or properties whose content is sent with
+// chrome:metaadded, a trailing '*' matches any suffix
+#define META_WHITELIST_PREF "embedlite.chrome.meta.whitelist"
+#define META_WHITELIST_DEFAULT "viewport,theme-color,og:*"
+
+static StaticAutoPtr<nsTArray<nsCString> > sMetaWhitelist;
+
+static void
+MetaWhitelistChanged(const char* aPref, void* aClosure)
+{
+    if (!sMetaWhitelist) {
+        return;
+    }
+    nsAdoptingCString value = Preferences::GetCString(META_WHITELIST_PREF);
+    if (!value) {
+        value.AssignLiteral(META_WHITELIST_DEFAULT);
+    }
+
+    sMetaWhitelist->Clear();
+    nsCCharSeparatedTokenizer tokenizer(value, ',');
+    while (tokenizer.hasMoreTokens()) {
+        const nsCSubstring& token = tokenizer.nextToken();
+        if (!token.IsEmpty()) {
+            nsCString* entry = sMetaWhitelist->AppendElement(token);
+            ToLowerCase(*entry);
+        }
+    }
+}
+
+static bool
+IsWhitelistedMeta(const nsAString& aKey)
+{
+    if (aKey.IsEmpty()) {
+        return false;
+    }
+    if (!sMetaWhitelist) {
+        sMetaWhitelist = new nsTArray<nsCString>();
+        ClearOnShutdown(&sMetaWhitelist);
+        MetaWhitelistChanged(META_WHITELIST_PREF, nullptr);
+        Preferences::RegisterCallback(MetaWhitelistChanged, META_WHITELIST_PREF);
+    }
+
+    NS_ConvertUTF16toUTF8 key(aKey);
+    ToLowerCase(key);
+    for (uint32_t i = 0; i < sMetaWhitelist->Length(); ++i) {
+        const nsCString& entry = sMetaWhitelist->ElementAt(i);
+        if (entry.Last() == '*') {
+            if (StringBeginsWith(key, Substring(entry, 0, entry.Length() - 1))) {
+                return true;
+            }
+        } else if (key.Equals(entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define CHROME_EVENT(_type) { _type, "embedlite.chrome.events." _type }
+
+// Indexed by EmbedChromeEventID, events default to enabled
+static const struct {
+    const char* mType;
+    const char* mPref;
+} sChromeEvents[] = {
+    CHROME_EVENT(MOZ_DOMContentLoaded),
+    CHROME_EVENT(MOZ_DOMLinkAdded),
+    CHROME_EVENT(MOZ_DOMWillOpenModalDialog),
+    CHROME_EVENT(MOZ_DOMModalDialogClosed),
+    CHROME_EVENT(MOZ_DOMWindowClose),
+    CHROME_EVENT(MOZ_DOMMetaAdded)
+};
+
+#undef CHROME_EVENT
+
+static_assert(MOZ_ARRAY_LENGTH(sChromeEvents) == eChromeEvent_Count,
+              "sChromeEvents must match EmbedChromeEventID");
+
+/**
+ * Fields of one chrome message, read from the DOM on the main thread.
+ * A chrome:headbatch message carries the batched messages as entries.
+ */
+class EmbedChromeMessage MOZ_FINAL : public EmbedJSONMessage
+{
+public:
+    EmbedChromeMessage(uint32_t aWinId)
+      : mWinId(aWinId)
+    {
+    }
+
+    void AddField(const char* aName, const nsAString& aValue)
+    {
+        Field* field = mFields.AppendElement();
+        field->mName = aName;
+        field->mValue = aValue;
+        field->mIsInt = false;
+    }
+
+    void AddIntField(const char* aName, int64_t aValue)
+    {
+        Field* field = mFields.AppendElement();
+        field->mName = aName;
+        field->mInt = aValue;
+        field->mIsInt = true;
+    }
+
+    virtual void Write(EmbedJSONWriter& aWriter)
+    {
+        aWriter.BeginObject();
+        if (mEntries.IsEmpty()) {
+            WriteFields(aWriter);
+        } else {
+            aWriter.BeginArray("entries");
+            for (uint32_t i = 0; i < mEntries.Length(); ++i) {
+                aWriter.BeginObject();
+                aWriter.StringProperty("name", mEntries[i]->mName);
+                aWriter.BeginObject("data");
+                mEntries[i]->WriteFields(aWriter);
+                aWriter.EndObject();
+                aWriter.EndObject();
+            }
+            aWriter.EndArray();
+        }
+        aWriter.EndObject();
+    }
+
+    virtual void Deliver(const nsAString& aJSON)
+    {
+        // Not kept in the message, which may be released off the main thread
+        nsCOMPtr<nsIEmbedAppService> service = do_GetService("@mozilla.org/embedlite-app-service;1");
+        NS_ENSURE_TRUE(service, );
+        service->EnterSecureJSContext();
+        service->SendAsyncMessage(mWinId, mName.get(), PromiseFlatString(aJSON).get());
+        service->LeaveSecureJSContext();
+    }
+
+    uint32_t mWinId;
+    nsString mName;
+    nsTArray<nsRefPtr<EmbedChromeMessage> > mEntries;
+
+private:
+    void WriteFields(EmbedJSONWriter& aWriter)
+    {
+        for (uint32_t i = 0; i < mFields.Length(); ++i) {
+            if (mFields[i].mIsInt) {
+                aWriter.IntProperty(mFields[i].mName, mFields[i].mInt);
+            } else {
+                aWriter.StringProperty(mFields[i].mName, mFields[i].mValue);
+            }
+        }
+    }
+
+    struct Field
+    {
+        const char* mName;
+        nsString mValue;
+        int64_t mInt;
+        bool mIsInt;
+    };
+    nsAutoTArray<Field, 6> mFields;
+};
+
+EmbedChromeListener::EmbedChromeListener(nsIDOMWindow* aWin, nsIThread* aSerializer)
   :  DOMWindow(aWin)
   ,  mWindowCounter(0)
+  ,  mSerializer(aSerializer)
+  ,  mMessage(mMessageStorage, MESSAGE_BUFFER_RESERVE, 0)
+  ,  mBatchWinId(0)
+  ,  mLoadedNavStart(0)
+  ,  mFirstPaintNavStart(0)
+  ,  mFirstPaint(0)
 {
     if (!mService) {
         mService = do_GetService("@mozilla.org/embedlite-app-service;1");
     }
+
+    static bool sPrefCached = false;
+    if (!sPrefCached) {
+        sPrefCached = true;
+        Preferences::AddBoolVarCache(&sHeadBatch, HEADBATCH_PREF, false);
+        Preferences::AddBoolVarCache(&sLoadTiming, LOADTIMING_PREF, false);
+        Preferences::AddBoolVarCache(&sLoadTimingAggregate, LOADTIMING_AGGREGATE_PREF, false);
+    }
 }
 
+/**
+ * Registered for a single event type, so the event ID is known without
+ * looking at the event type string. Does not own the chrome listener,
+ * which disconnects it when going away.
+ */
+class EmbedChromeEventListener MOZ_FINAL : public nsIDOMEventListener
+{
+public:
+    EmbedChromeEventListener(EmbedChromeListener* aListener, EmbedChromeEventID aEventID)
+      : mListener(aListener)
+      , mEventID(aEventID)
+    {
+    }
+
+    NS_DECL_ISUPPORTS
+
+    NS_IMETHOD HandleEvent(nsIDOMEvent* aEvent)
+    {
+        if (!mListener) {
+            return NS_OK;
+        }
+        return mListener->HandleEvent(aEvent, mEventID);
+    }
+
+    void Disconnect()
+    {
+        mListener = nullptr;
+    }
+
+private:
+    ~EmbedChromeEventListener() {}
+
+    EmbedChromeListener* mListener;
+    EmbedChromeEventID mEventID;
+};
+
+NS_IMPL_ISUPPORTS(EmbedChromeEventListener, nsIDOMEventListener)
+
 EmbedChromeListener::~EmbedChromeListener()
 {
+    if (mBatchTimer) {
+        mBatchTimer->Cancel();
+    }
+    for (uint32_t i = 0; i < eChromeEvent_Count; ++i) {
+        if (mListeners[i]) {
+            mListeners[i]->Disconnect();
+        }
+    }
+}
+
+NS_IMPL_ISUPPORTS0(EmbedChromeListener)
+
+void
+EmbedChromeListener::AddEventListeners(nsIDOMEventTarget* aTarget)
+{
+    for (uint32_t i = 0; i < eChromeEvent_Count; ++i) {
+        if (mListeners[i] || !Preferences::GetBool(sChromeEvents[i].mPref, true)) {
+            continue;
+        }
+        nsRefPtr<EmbedChromeEventListener> listener =
+            new EmbedChromeEventListener(this, EmbedChromeEventID(i));
+        if (NS_SUCCEEDED(aTarget->AddEventListener(NS_ConvertASCIItoUTF16(sChromeEvents[i].mType),
+                                                   listener, false))) {
+            mListeners[i] = listener;
+        }
+    }
 }
 
-NS_IMPL_ISUPPORTS(EmbedChromeListener, nsIDOMEventListener)
+void
+EmbedChromeListener::RemoveEventListeners(nsIDOMEventTarget* aTarget)
+{
+    // Prefs may have changed since, remove what was actually added
+    for (uint32_t i = 0; i < eChromeEvent_Count; ++i) {
+        if (mListeners[i]) {
+            aTarget->RemoveEventListener(NS_ConvertASCIItoUTF16(sChromeEvents[i].mType),
+                                         mListeners[i], false);
+            mListeners[i]->Disconnect();
+            mListeners[i] = nullptr;
+        }
+    }
+}
 
 nsresult
 GetDOMWindowByNode(nsIDOMNode *aNode, nsIDOMWindow **aDOMWindow)
@@ -73,48 +432,66 @@ GetTopWindow(nsIDOMWindow* aWin, nsIDOMWindow **aDOMWindow)
 }
 
 
-NS_IMETHODIMP
-EmbedChromeListener::HandleEvent(nsIDOMEvent* aEvent)
+nsresult
+EmbedChromeListener::HandleEvent(nsIDOMEvent* aEvent, EmbedChromeEventID aEventID)
 {
-    nsresult rv;
-    nsString type;
-    if (aEvent) {
-        aEvent->GetType(type);
-    }
-    // LOGT("Event:'%s'", NS_ConvertUTF16toUTF8(type).get());
-
-    nsString messageName;
-    nsString message;
-    // Just simple property bag support still
-    nsCOMPtr<nsIEmbedLiteJSON> json = do_GetService("@mozilla.org/embedlite-json;1", &rv);
-    if (!json) {
-        LOGT("Failed to create json component");
-    }
-    nsCOMPtr<nsIWritablePropertyBag2> root;
-    json->CreateObject(getter_AddRefs(root));
-
     nsCOMPtr<nsIDOMWindow> docWin = do_GetInterface(DOMWindow);
     nsCOMPtr<nsPIDOMWindow> window = do_GetInterface(DOMWindow);
 
     uint32_t winid;
     mService->GetIDByWindow(window, &winid);
     NS_ENSURE_TRUE(winid , NS_ERROR_FAILURE);
+
+    // Only the DOM is read in the secure context, the message is
+    // serialized and sent afterwards
+    nsRefPtr<EmbedChromeMessage> message = new EmbedChromeMessage(winid);
+    nsString& messageName = message->mName;
     mService->EnterSecureJSContext();
     nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(window);
 
-    if (type.EqualsLiteral(MOZ_DOMMetaAdded)) {
+    switch (aEventID) {
+    case eChromeEvent_DOMMetaAdded: {
         messageName.AssignLiteral("chrome:metaadded");
-    } else if (type.EqualsLiteral(MOZ_DOMContentLoaded)) {
+        // Whitelisted metas carry their values, others are sent bare as before
+        nsCOMPtr<nsIDOMEventTarget> origTarget;
+        aEvent->GetOriginalTarget(getter_AddRefs(origTarget));
+        nsCOMPtr<nsIDOMElement> element = do_QueryInterface(origTarget);
+        if (!element) {
+            break;
+        }
+        nsString name, property;
+        element->GetAttribute(NS_LITERAL_STRING("name"), name);
+        element->GetAttribute(NS_LITERAL_STRING("property"), property);
+        if (IsWhitelistedMeta(name) || IsWhitelistedMeta(property)) {
+            nsString content;
+            element->GetAttribute(NS_LITERAL_STRING("content"), content);
+            message->AddField("name", name);
+            message->AddField("property", property);
+            message->AddField("content", content);
+        }
+        break;
+    }
+    case eChromeEvent_DOMContentLoaded: {
         nsCOMPtr<nsIDOMDocument> ctDoc;
         window->GetDocument(getter_AddRefs(ctDoc));
         nsString docURI;
         ctDoc->GetDocumentURI(docURI);
         if (!docURI.EqualsLiteral("about:blank")) {
             messageName.AssignLiteral("chrome:contentloaded");
-            root->SetPropertyAsAString(NS_LITERAL_STRING("docuri"), docURI);
+            message->AddField("docuri", docURI);
+            // Subframes fire DOMContentLoaded up to the chrome handler
+            // too, only the top level document's timing is reported
+            nsCOMPtr<nsIDOMEventTarget> origTarget;
+            aEvent->GetOriginalTarget(getter_AddRefs(origTarget));
+            nsCOMPtr<nsIDOMDocument> loadedDoc = do_QueryInterface(origTarget);
+            if (sLoadTiming && loadedDoc && loadedDoc == ctDoc) {
+                AddLoadTiming(message, loadedDoc);
+            }
         }
         // Need send session history from here
-    } else if (type.EqualsLiteral(MOZ_DOMLinkAdded)) {
+        break;
+    }
+    case eChromeEvent_DOMLinkAdded: {
         nsCOMPtr<nsIDOMEventTarget> origTarget;
         aEvent->GetOriginalTarget(getter_AddRefs(origTarget));
         nsCOMPtr<nsIDOMHTMLLinkElement> disabledIface = do_QueryInterface(origTarget);
@@ -149,26 +526,205 @@ EmbedChromeListener::HandleEvent(nsIDOMEvent* aEvent)
             element->GetAttribute(NS_LITERAL_STRING("sizes"), sizes);
         }
         messageName.AssignLiteral("chrome:linkadded");
-        root->SetPropertyAsAString(NS_LITERAL_STRING("href"), href);
-        root->SetPropertyAsAString(NS_LITERAL_STRING("charset"), charset);
-        root->SetPropertyAsAString(NS_LITERAL_STRING("title"), title);
-        root->SetPropertyAsAString(NS_LITERAL_STRING("rel"), rel);
-        root->SetPropertyAsAString(NS_LITERAL_STRING("sizes"), sizes);
-        root->SetPropertyAsAString(NS_LITERAL_STRING("get"), type);
-    } else if (type.EqualsLiteral(MOZ_DOMWillOpenModalDialog) ||
-               type.EqualsLiteral(MOZ_DOMModalDialogClosed) ||
-               type.EqualsLiteral(MOZ_DOMWindowClose)) {
+        message->AddField("href", href);
+        message->AddField("charset", charset);
+        message->AddField("title", title);
+        message->AddField("rel", rel);
+        message->AddField("sizes", sizes);
+        message->AddField("get", type);
+        break;
+    }
+    case eChromeEvent_DOMWillOpenModalDialog:
+    case eChromeEvent_DOMModalDialogClosed:
+    case eChromeEvent_DOMWindowClose:
         messageName.AssignLiteral("chrome:winopenclose");
-        root->SetPropertyAsAString(NS_LITERAL_STRING("type"), type);
-    } else {
+        message->AddField("type", type);
+        break;
+    default:
         mService->LeaveSecureJSContext();
         return NS_OK;
     }
 
-    nsString outStr;
-    json->CreateJSON(root, message);
-    mService->SendAsyncMessage(winid, messageName.get(), message.get());
     mService->LeaveSecureJSContext();
 
+    if (sHeadBatch && (aEventID == eChromeEvent_DOMLinkAdded || aEventID == eChromeEvent_DOMMetaAdded)) {
+        nsCOMPtr<nsIDOMDocument> ctDoc;
+        window->GetDocument(getter_AddRefs(ctDoc));
+        QueueHeadEntry(winid, ctDoc, message);
+        return NS_OK;
+    }
+
+    if (aEventID == eChromeEvent_DOMContentLoaded && !mBatch.IsEmpty()) {
+        // Head entries of the loaded document go out before contentloaded
+        nsCOMPtr<nsIDOMEventTarget> origTarget;
+        aEvent->GetOriginalTarget(getter_AddRefs(origTarget));
+        nsCOMPtr<nsIDOMDocument> loadedDoc = do_QueryInterface(origTarget);
+        if (loadedDoc == mBatchDocument) {
+            FlushHeadBatch();
+        }
+    }
+
+    message->Dispatch(mSerializer, &mMessage);
+
     return NS_OK;
 }
+
+void
+EmbedChromeListener::QueueHeadEntry(uint32_t aWinId, nsIDOMDocument* aDocument, EmbedChromeMessage* aMessage)
+{
+    if (!mBatch.IsEmpty() && mBatchDocument != aDocument) {
+        FlushHeadBatch();
+    }
+    mBatchWinId = aWinId;
+    mBatchDocument = aDocument;
+
+    // Entries carry the message they replace, {"name":...,"data":{...}}
+    mBatch.AppendElement(aMessage);
+
+    nsString readyState;
+    if (aDocument) {
+        aDocument->GetReadyState(readyState);
+    }
+    bool loading = readyState.EqualsLiteral("loading");
+    // While loading the timer only bounds the wait for DOMContentLoaded,
+    // afterwards every entry restarts it
+    if (loading && mBatch.Length() > 1) {
+        return;
+    }
+
+    if (!mBatchTimer) {
+        mBatchTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+    }
+    if (!mBatchTimer ||
+        NS_FAILED(mBatchTimer->InitWithFuncCallback(FlushHeadBatchCallback, this,
+                                                    loading ? HEADBATCH_MAX_DELAY : HEADBATCH_IDLE_DELAY,
+                                                    nsITimer::TYPE_ONE_SHOT))) {
+        FlushHeadBatch();
+    }
+}
+
+void
+EmbedChromeListener::FlushHeadBatch()
+{
+    if (mBatchTimer) {
+        mBatchTimer->Cancel();
+    }
+    if (mBatch.IsEmpty()) {
+        return;
+    }
+
+    nsRefPtr<EmbedChromeMessage> message = new EmbedChromeMessage(mBatchWinId);
+    message->mName.AssignLiteral("chrome:headbatch");
+    message->mEntries.SwapElements(mBatch);
+    mBatchDocument = nullptr;
+
+    message->Dispatch(mSerializer, &mMessage);
+}
+
+/*static*/
+void
+EmbedChromeListener::FlushHeadBatchCallback(nsITimer* aTimer, void* aClosure)
+{
+    static_cast<EmbedChromeListener*>(aClosure)->FlushHeadBatch();
+}
+
+void
+EmbedChromeListener::AddLoadTiming(EmbedChromeMessage* aMessage, nsIDOMDocument* aDocument)
+{
+    nsCOMPtr<nsIDocument> doc = do_QueryInterface(aDocument);
+    DOMTimeMilliSec navStart = GetNavigationStart(doc);
+    if (!navStart) {
+        return;
+    }
+    mLoadedNavStart = navStart;
+
+    // Everything below is in ms relative to navigation start, -1 if unknown
+    int64_t responseEnd = -1;
+    nsCOMPtr<nsITimedChannel> channel = do_QueryInterface(doc->GetChannel());
+    PRTime responseEndTime = 0;
+    if (channel && NS_SUCCEEDED(channel->GetResponseEndTime(&responseEndTime)) && responseEndTime) {
+        responseEnd = responseEndTime / PR_USEC_PER_MSEC - navStart;
+    }
+
+    DOMTimeMilliSec contentLoaded = doc->GetNavigationTiming()->GetDomContentLoadedEventStart();
+    if (!contentLoaded) {
+        contentLoaded = PR_Now() / PR_USEC_PER_MSEC;
+    }
+    int64_t domContentLoaded = contentLoaded - navStart;
+
+    // Painted before DOMContentLoaded, otherwise OnFirstPaint() reports it
+    int64_t firstPaint = -1;
+    if (mFirstPaintNavStart == navStart) {
+        firstPaint = mFirstPaint - navStart;
+        mFirstPaintNavStart = 0;
+    }
+
+    aMessage->AddIntField("navigationStart", navStart);
+    aMessage->AddIntField("responseEnd", responseEnd);
+    aMessage->AddIntField("domContentLoaded", domContentLoaded);
+    aMessage->AddIntField("firstPaint", firstPaint);
+
+    if (!sLoadTimingAggregate) {
+        return;
+    }
+    OriginTiming* origin = GetOriginTiming(doc);
+    if (!origin) {
+        return;
+    }
+    UpdateAverage(origin->mDomContentLoaded, origin->mLoads, domContentLoaded);
+    if (responseEnd >= 0) {
+        UpdateAverage(origin->mResponseEnd, origin->mResponses, responseEnd);
+    }
+    if (firstPaint >= 0) {
+        UpdateAverage(origin->mFirstPaint, origin->mPaints, firstPaint);
+    }
+    aMessage->AddIntField("originLoads", origin->mLoads);
+    aMessage->AddIntField("avgResponseEnd", origin->mResponses ? int64_t(origin->mResponseEnd) : -1);
+    aMessage->AddIntField("avgDomContentLoaded", int64_t(origin->mDomContentLoaded));
+    aMessage->AddIntField("avgFirstPaint", origin->mPaints ? int64_t(origin->mFirstPaint) : -1);
+}
+
+void
+EmbedChromeListener::OnFirstPaint(nsIDocument* aDocument)
+{
+    if (!sLoadTiming) {
+        return;
+    }
+    DOMTimeMilliSec navStart = GetNavigationStart(aDocument);
+    if (!navStart) {
+        return;
+    }
+    DOMTimeMilliSec now = PR_Now() / PR_USEC_PER_MSEC;
+    if (navStart != mLoadedNavStart) {
+        // Goes out with chrome:contentloaded
+        mFirstPaintNavStart = navStart;
+        mFirstPaint = now;
+        return;
+    }
+
+    nsCOMPtr<nsPIDOMWindow> window = do_GetInterface(DOMWindow);
+    uint32_t winid = 0;
+    mService->GetIDByWindow(window, &winid);
+    NS_ENSURE_TRUE(winid, );
+
+    nsAutoCString spec;
+    if (aDocument->GetDocumentURI()) {
+        aDocument->GetDocumentURI()->GetSpec(spec);
+    }
+    int64_t firstPaint = now - navStart;
+    nsRefPtr<EmbedChromeMessage> message = new EmbedChromeMessage(winid);
+    message->mName.AssignLiteral("chrome:firstpaint");
+    message->AddField("docuri", NS_ConvertUTF8toUTF16(spec));
+    message->AddIntField("navigationStart", navStart);
+    message->AddIntField("firstPaint", firstPaint);
+    if (sLoadTimingAggregate) {
+        OriginTiming* origin = GetOriginTiming(aDocument);
+        if (origin) {
+            UpdateAverage(origin->mFirstPaint, origin->mPaints, firstPaint);
+            message->AddIntField("avgFirstPaint", int64_t(origin->mFirstPaint));
+        }
+    }
+    mLoadedNavStart = 0;
+
+    message->Dispatch(mSerializer, &mMessage);
+}
@@ -12,6 +12,13 @@
 #include "nsIDOMEventListener.h"
 #include "nsIEmbedAppService.h"
 #include "nsIDOMWindow.h"
+#include "nsStringGlue.h"
+#include "nsITimer.h"
+#include "nsIDOMDocument.h"
+#include "nsIDOMEventTarget.h"
+#include "nsIThread.h"
+#include "nsTArray.h"
+#include "nsAutoPtr.h"
 
 #define MOZ_DOMContentLoaded "DOMContentLoaded"
 #define MOZ_DOMLinkAdded "DOMLinkAdded"
@@ -20,20 +27,72 @@
 #define MOZ_DOMWindowClose "DOMWindowClose"
 #define MOZ_DOMMetaAdded "DOMMetaAdded"
 
-class EmbedChromeListener : public nsIDOMEventListener
+// Characters of the reused message buffer, fits a typical linkadded
+#define MESSAGE_BUFFER_RESERVE 512
+
+// Events handled by EmbedChromeListener, indexes into its event table
+enum EmbedChromeEventID
+{
+    eChromeEvent_DOMContentLoaded,
+    eChromeEvent_DOMLinkAdded,
+    eChromeEvent_DOMWillOpenModalDialog,
+    eChromeEvent_DOMModalDialogClosed,
+    eChromeEvent_DOMWindowClose,
+    eChromeEvent_DOMMetaAdded,
+    eChromeEvent_Count,
+    eChromeEvent_Unknown = eChromeEvent_Count
+};
+
+class EmbedChromeMessage;
+class EmbedChromeEventListener;
+class nsIDocument;
+
+class EmbedChromeListener : public nsISupports
 {
 public:
-    EmbedChromeListener(nsIDOMWindow* aWin);
+    // Messages are serialized on aSerializer when given, see EmbedJSONMessage
+    EmbedChromeListener(nsIDOMWindow* aWin, nsIThread* aSerializer = nullptr);
 
     NS_DECL_ISUPPORTS
-    NS_DECL_NSIDOMEVENTLISTENER
+
+    // Listen to the events enabled by embedlite.chrome.events.<type> prefs
+    void AddEventListeners(nsIDOMEventTarget* aTarget);
+    void RemoveEventListeners(nsIDOMEventTarget* aTarget);
+
+    // Called by the listener registered for aEventID
+    nsresult HandleEvent(nsIDOMEvent* aEvent, EmbedChromeEventID aEventID);
+
+    // Called on embedlite-before-first-paint for a document of this window
+    void OnFirstPaint(nsIDocument* aDocument);
 
     nsCOMPtr<nsIDOMWindow> DOMWindow;
 private:
     virtual ~EmbedChromeListener();
 
+    void QueueHeadEntry(uint32_t aWinId, nsIDOMDocument* aDocument, EmbedChromeMessage* aMessage);
+    void FlushHeadBatch();
+    static void FlushHeadBatchCallback(nsITimer* aTimer, void* aClosure);
+    void AddLoadTiming(EmbedChromeMessage* aMessage, nsIDOMDocument* aDocument);
+
     nsCOMPtr<nsIEmbedAppService> mService;
     int mWindowCounter;
+    nsCOMPtr<nsIThread> mSerializer;
+    // Reused for every message serialized on the main thread. Backed by
+    // inline storage, so truncating it before each message keeps the buffer
+    char16_t mMessageStorage[MESSAGE_BUFFER_RESERVE];
+    nsFixedString mMessage;
+    // Link and meta entries of mBatchDocument waiting for chrome:headbatch
+    nsTArray<nsRefPtr<EmbedChromeMessage> > mBatch;
+    uint32_t mBatchWinId;
+    nsCOMPtr<nsIDOMDocument> mBatchDocument;
+    nsCOMPtr<nsITimer> mBatchTimer;
+    // Listener per EmbedChromeEventID registered by AddEventListeners()
+    nsRefPtr<EmbedChromeEventListener> mListeners[eChromeEvent_Count];
+    // Navigation start of the document whose DOMContentLoaded was reported,
+    // and of the one painted before it, in ms since the epoch
+    uint64_t mLoadedNavStart;
+    uint64_t mFirstPaintNavStart;
+    uint64_t mFirstPaint;
 };
 
 #endif /*EmbedChromeListener_H_*/
@@ -28,9 +28,14 @@
 #include "nsIFocusManager.h"
 #include "nsIDocShellTreeItem.h"
 #include "nsIWebNavigation.h"
+#include "nsThreadUtils.h"
+#include "mozilla/Preferences.h"
+#include "nsIDocument.h"
+
+// Serialize chrome messages on a helper thread
+#define OFFMAINTHREAD_PREF "embedlite.chrome.json.offmainthread"
 
 EmbedChromeManager::EmbedChromeManager()
-  : mWindowCounter(0)
 {
 }
 
@@ -56,6 +61,10 @@ EmbedChromeManager::Init()
                                           "domwindowclosed",
                                           true);
         NS_ENSURE_SUCCESS(rv, rv);
+        rv = observerService->AddObserver(this,
+                                          "embedlite-before-first-paint",
+                                          true);
+        NS_ENSURE_SUCCESS(rv, rv);
         rv = observerService->AddObserver(this, NS_XPCOM_SHUTDOWN_OBSERVER_ID,
                                           false);
         NS_ENSURE_SUCCESS(rv, rv);
@@ -78,6 +87,15 @@ EmbedChromeManager::Observe(nsISupports *aSubject,
         nsCOMPtr<nsIDOMWindow> win = do_QueryInterface(aSubject, &rv);
         NS_ENSURE_SUCCESS(rv, NS_OK);
         WindowDestroyed(win);
+    } else if (!strcmp(aTopic, "embedlite-before-first-paint")) {
+        FirstPaint(aSubject);
+    } else if (!strcmp(aTopic, NS_XPCOM_SHUTDOWN_OBSERVER_ID)) {
+        // Delivers whatever is still being serialized, listeners fall
+        // back to the main thread afterwards
+        if (mSerializer) {
+            mSerializer->Shutdown();
+            mSerializer = nullptr;
+        }
     } else {
         LOGT("obj:%p, top:%s", aSubject, aTopic);
     }
@@ -93,15 +111,15 @@ EmbedChromeManager::WindowCreated(nsIDOMWindow* aWin)
     NS_ENSURE_TRUE(pidomWindow, );
     nsCOMPtr<nsIDOMEventTarget> target = do_QueryInterface(pidomWindow->GetChromeEventHandler());
     NS_ENSURE_TRUE(target, );
-    nsCOMPtr<EmbedChromeListener> listener = new EmbedChromeListener(aWin);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMContentLoaded), listener,  PR_FALSE);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMLinkAdded), listener,  PR_FALSE);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMWillOpenModalDialog), listener,  PR_FALSE);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMModalDialogClosed), listener,  PR_FALSE);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMWindowClose), listener,  PR_FALSE);
-    target->AddEventListener(NS_LITERAL_STRING(MOZ_DOMMetaAdded), listener,  PR_FALSE);
-    mArray.AppendObject(listener);
-    mWindowCounter++;
+    if (mListeners.Contains(aWin)) {
+        return;
+    }
+    if (!mSerializer && mozilla::Preferences::GetBool(OFFMAINTHREAD_PREF, false)) {
+        NS_NewNamedThread("ChromeJSON", getter_AddRefs(mSerializer));
+    }
+    nsRefPtr<EmbedChromeListener> listener = new EmbedChromeListener(aWin, mSerializer);
+    listener->AddEventListeners(target);
+    mListeners.Put(aWin, listener);
     if (!mService) {
         mService = do_GetService("@mozilla.org/embedlite-app-service;1");
     }
@@ -111,28 +129,47 @@ void
 EmbedChromeManager::WindowDestroyed(nsIDOMWindow* aWin)
 {
     LOGT("WindowClosed: %p", aWin);
+    nsRefPtr<EmbedChromeListener> listener;
+    if (!mListeners.Get(aWin, getter_AddRefs(listener))) {
+        return;
+    }
+    // Listener comes off the chrome event handler before its entry goes,
+    // the entry is dropped even if the handler is already gone
     nsCOMPtr<nsPIDOMWindow> pidomWindow = do_GetInterface(aWin);
-    NS_ENSURE_TRUE(pidomWindow, );
-    nsCOMPtr<nsIDOMEventTarget> target = do_QueryInterface(pidomWindow->GetChromeEventHandler());
-    NS_ENSURE_TRUE(target, );
-    nsCOMPtr<EmbedChromeListener> listener;
-    int i = 0;
-    for (i = 0; i < mArray.Count(); ++i) {
-        if (mArray[i]->DOMWindow.get() == aWin) {
-            listener = mArray[i];
-            break;
-        }
+    nsCOMPtr<nsIDOMEventTarget> target;
+    if (pidomWindow) {
+        target = do_QueryInterface(pidomWindow->GetChromeEventHandler());
+    }
+    if (target) {
+        listener->RemoveEventListeners(target);
     }
-    mArray.RemoveObjectAt(i);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMContentLoaded), listener,  PR_FALSE);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMLinkAdded), listener,  PR_FALSE);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMWillOpenModalDialog), listener,  PR_FALSE);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMModalDialogClosed), listener,  PR_FALSE);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMWindowClose), listener,  PR_FALSE);
-    target->RemoveEventListener(NS_LITERAL_STRING(MOZ_DOMMetaAdded), listener,  PR_FALSE);
-    mWindowCounter--;
-    if (!mWindowCounter) {
+    mListeners.Remove(aWin);
+    if (!mListeners.Count()) {
         mService = nullptr;
     }
 }
 
+
+void
+EmbedChromeManager::FirstPaint(nsISupports* aSubject)
+{
+    if (!mListeners.Count()) {
+        return;
+    }
+    // Subject is the painted document or its window
+    nsCOMPtr<nsIDocument> doc = do_QueryInterface(aSubject);
+    nsCOMPtr<nsPIDOMWindow> window = do_QueryInterface(aSubject);
+    if (doc) {
+        window = doc->GetWindow();
+    } else if (window) {
+        doc = window->GetExtantDoc();
+    }
+    NS_ENSURE_TRUE(doc && window, );
+
+    nsCOMPtr<nsIDOMWindow> top;
+    window->GetTop(getter_AddRefs(top));
+    nsRefPtr<EmbedChromeListener> listener;
+    if (top && mListeners.Get(top, getter_AddRefs(listener))) {
+        listener->OnFirstPaint(doc);
+    }
+}
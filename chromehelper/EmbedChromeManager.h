@@ -12,7 +12,9 @@
 #include "nsIDOMEventListener.h"
 #include "nsIEmbedAppService.h"
 #include "EmbedChromeListener.h"
-#include "nsCOMArray.h"
+#include "nsRefPtrHashtable.h"
+#include "nsHashKeys.h"
+#include "nsIThread.h"
 
 class EmbedChromeManager : public nsIObserver,
                            public nsSupportsWeakReference
@@ -29,10 +31,11 @@ private:
 
     void WindowCreated(nsIDOMWindow* aWin);
     void WindowDestroyed(nsIDOMWindow* aWin);
+    void FirstPaint(nsISupports* aSubject);
     nsCOMPtr<nsIEmbedAppService> mService;
-    int mWindowCounter;
-    typedef nsCOMArray<EmbedChromeListener> ObserversArray;
-    ObserversArray mArray;
+    typedef nsRefPtrHashtable<nsPtrHashKey<nsIDOMWindow>, EmbedChromeListener> ListenersTable;
+    ListenersTable mListeners;
+    nsCOMPtr<nsIThread> mSerializer;
 };
 
 #define NS_EMBED_CHROME_CONTRACTID "@mozilla.org/embed-chrome-component;1"
@@ -0,0 +1,68 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedJSONMessage_H_
+#define EmbedJSONMessage_H_
+
+#include "nsISupportsImpl.h"
+#include "nsIEventTarget.h"
+#include "nsThreadUtils.h"
+#include "nsStringGlue.h"
+#include "EmbedJSONWriter.h"
+
+/**
+ * Outgoing message whose fields were captured on the main thread.
+ *
+ * Dispatch() serializes it with Write() on the given thread and hands the
+ * JSON back to Deliver() on the main thread. Messages dispatched to the
+ * same thread are delivered in order. Without a thread, or once it is
+ * shut down, both steps run synchronously.
+ */
+class EmbedJSONMessage
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(EmbedJSONMessage)
+
+  // Any thread, only reads fields set before Dispatch()
+  virtual void Write(EmbedJSONWriter& aWriter) = 0;
+  // Main thread
+  virtual void Deliver(const nsAString& aJSON) = 0;
+
+  // aBuffer, when given, is used instead of a new string if the message
+  // is serialized synchronously
+  void Dispatch(nsIEventTarget* aThread, nsAString* aBuffer = nullptr)
+  {
+    if (aThread &&
+        NS_SUCCEEDED(aThread->Dispatch(NS_NewRunnableMethod(this, &EmbedJSONMessage::Serialize),
+                                       NS_DISPATCH_NORMAL))) {
+      return;
+    }
+
+    nsAString& json = aBuffer ? *aBuffer : mJSON;
+    EmbedJSONWriter writer(json);
+    Write(writer);
+    Deliver(json);
+  }
+
+protected:
+  virtual ~EmbedJSONMessage() {}
+
+private:
+  void Serialize()
+  {
+    EmbedJSONWriter writer(mJSON);
+    Write(writer);
+    NS_DispatchToMainThread(NS_NewRunnableMethod(this, &EmbedJSONMessage::DeliverSerialized));
+  }
+
+  void DeliverSerialized()
+  {
+    Deliver(mJSON);
+  }
+
+  nsString mJSON;
+};
+
+#endif /*EmbedJSONMessage_H_*/
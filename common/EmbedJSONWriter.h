@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedJSONWriter_H_
+#define EmbedJSONWriter_H_
+
+#include "nsStringGlue.h"
+
+/**
+ * Writes fixed-shape JSON messages straight into a string.
+ *
+ * Produces the same text nsIEmbedLiteJSON::CreateJSON would for simple
+ * objects, without a property bag or nsIVariant per field. Callers are
+ * expected to emit well-formed nesting.
+ */
+class EmbedJSONWriter
+{
+public:
+  explicit EmbedJSONWriter(nsAString& aOut, uint32_t aReserve = 0)
+    : mOut(aOut)
+    , mNeedComma(false)
+  {
+    mOut.Truncate();
+    if (aReserve) {
+      mOut.SetCapacity(aReserve);
+    }
+  }
+
+  void BeginObject(const char* aName = nullptr)
+  {
+    Separator(aName);
+    mOut.Append(char16_t('{'));
+    mNeedComma = false;
+  }
+
+  void EndObject()
+  {
+    mOut.Append(char16_t('}'));
+    mNeedComma = true;
+  }
+
+  void BeginArray(const char* aName = nullptr)
+  {
+    Separator(aName);
+    mOut.Append(char16_t('['));
+    mNeedComma = false;
+  }
+
+  void EndArray()
+  {
+    mOut.Append(char16_t(']'));
+    mNeedComma = true;
+  }
+
+  // Pass a null name for array elements
+  void StringProperty(const char* aName, const nsAString& aValue)
+  {
+    Separator(aName);
+    AppendString(mOut, aValue);
+  }
+
+  void StringProperty(const char* aName, const nsACString& aValue)
+  {
+    Separator(aName);
+    AppendString(mOut, NS_ConvertUTF8toUTF16(aValue));
+  }
+
+  void IntProperty(const char* aName, int64_t aValue)
+  {
+    Separator(aName);
+    mOut.AppendInt(aValue);
+  }
+
+  void DoubleProperty(const char* aName, double aValue)
+  {
+    Separator(aName);
+    mOut.AppendFloat(aValue);
+  }
+
+  void BoolProperty(const char* aName, bool aValue)
+  {
+    Separator(aName);
+    if (aValue) {
+      mOut.AppendLiteral("true");
+    } else {
+      mOut.AppendLiteral("false");
+    }
+  }
+
+  static void AppendString(nsAString& aOut, const nsAString& aValue)
+  {
+    aOut.Append(char16_t('"'));
+    for (uint32_t i = 0; i < aValue.Length(); i++) {
+      char16_t c = aValue[i];
+      if (c == '"' || c == '\\') {
+        aOut.Append(char16_t('\\'));
+        aOut.Append(c);
+      } else if (c < 0x20) {
+        static const char kHex[] = "0123456789abcdef";
+        aOut.AppendLiteral("\\u00");
+        aOut.Append(char16_t(kHex[c >> 4]));
+        aOut.Append(char16_t(kHex[c & 0xf]));
+      } else {
+        aOut.Append(c);
+      }
+    }
+    aOut.Append(char16_t('"'));
+  }
+
+private:
+  void Separator(const char* aName)
+  {
+    if (mNeedComma) {
+      mOut.Append(char16_t(','));
+    }
+    mNeedComma = true;
+    if (aName) {
+      mOut.Append(char16_t('"'));
+      mOut.AppendASCII(aName);
+      mOut.AppendLiteral("\":");
+    }
+  }
+
+  nsAString& mOut;
+  bool mNeedComma;
+};
+
+#endif /*EmbedJSONWriter_H_*/
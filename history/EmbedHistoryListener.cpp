@@ -5,30 +5,241 @@
 #include "EmbedHistoryListener.h"
 #include "nsIURI.h"
 #include "mozilla/dom/Link.h"
+#include "mozilla/dom/Element.h"
+#include "mozilla/dom/DOMRect.h"
+#include "nsIDocument.h"
+#include "nsPIDOMWindow.h"
+#include "nsIDOMWindowUtils.h"
+#include "nsIInterfaceRequestorUtils.h"
+#include "nsISupportsPrimitives.h"
 #include "nsIEmbedLiteJSON.h"
+#include "EmbedJSONWriter.h"
+#include "EmbedJSONMessage.h"
 #include "nsIObserverService.h"
+#include "nsIFile.h"
+#include "nsDirectoryServiceUtils.h"
+#include "nsAppDirectoryServiceDefs.h"
+#include "nsComponentManagerUtils.h"
+#include "nsCharSeparatedTokenizer.h"
+#include "mozilla/Preferences.h"
+#include <math.h>
+#include <stdio.h>
 
 using namespace mozilla;
 using mozilla::dom::Link;
+using mozilla::dom::Element;
+using mozilla::dom::DOMRect;
 
-NS_IMPL_ISUPPORTS(EmbedHistoryListener, IHistory, nsIRunnable)
+NS_IMPL_ISUPPORTS(EmbedHistoryListener, IHistory, nsIRunnable, nsIObserver, nsIMemoryReporter)
 
 EmbedHistoryListener* EmbedHistoryListener::sHistory = NULL;
+bool EmbedHistoryListener::sUsePropertyBag = false;
+uint32_t EmbedHistoryListener::sFrecencyHalfLife = 0;
+bool EmbedHistoryListener::sLazyVisited = false;
+bool EmbedHistoryListener::sCollectStats = false;
+bool EmbedHistoryListener::sCheckVisitedBatch = false;
+uint32_t EmbedHistoryListener::sTitleDelay = 0;
+
+#define VISITED_FILTER_FILE "embedhistory.bloom"
+
+// Exists while the filter has changes not saved yet. Found at startup it
+// means they were lost, so the saved filter can no longer answer misses.
+#define VISITED_FILTER_DIRTY_FILE "embedhistory.bloom.dirty"
+
+// Delay in ms before filter changes are written out
+#define VISITED_FILTER_SAVE_DELAY 5000
+
+// Keep visits in a local database and resolve visited state from it
+#define LOCALSTORE_ENABLED_PREF "embedlite.history.localstore.enabled"
+
+// Send visited checks as one checkvisitedbatch message per flush, for
+// embedders that understand it. Off sends a checkvisited message per URI.
+#define CHECKVISITED_BATCH_PREF "embedlite.history.checkvisited.batch"
+
+// Coalescing window for checkvisitedbatch in ms, 0 means one main thread tick
+#define CHECKVISITED_DELAY_PREF "embedlite.history.checkvisited.delay"
+
+// Interval in ms over which title changes are coalesced into settitlebatch
+// messages, for embedders that understand them. 0 sends every change as a
+// settitle message.
+#define SETTITLE_DELAY_PREF "embedlite.history.settitle.delay"
+#define SETTITLE_DELAY_DEFAULT 0
+
+// Build single messages through nsIEmbedLiteJSON property bags as before
+#define JSON_PROPERTYBAG_PREF "embedlite.history.json.propertybag"
+
+// Hours after which a visit counts half towards frecency, 0 disables decay
+#define FRECENCY_HALFLIFE_PREF "embedlite.history.frecency.halflife"
+#define FRECENCY_HALFLIFE_DEFAULT (30 * 24)
+
+// Bonus added to the frecency of a URI for one visit
+#define FRECENCY_WEIGHT_DIRECT 120
+#define FRECENCY_WEIGHT_LINK 100
+
+// The frecency table is pruned of entries below FRECENCY_PRUNE_SCORE
+// once it holds more than FRECENCY_MAX_ENTRIES URIs
+#define FRECENCY_MAX_ENTRIES 4096
+#define FRECENCY_PRUNE_SCORE 1.0
+
+// Defer visited checks of top level links outside the viewport band,
+// needs the viewport updates sent by the touch helper
+#define LAZY_VISITED_PREF "embedlite.history.lazyvisited.enabled"
+
+// Screens added around the viewport on each side before a link counts as off screen
+#define LAZY_VISITED_BAND 1.0f
+
+// Delay in ms before deferred links are checked against a new viewport
+#define LAZY_VISITED_PASS_DELAY 100
+
+// Collect register to SetLinkState latency, see EmbedHistoryStats
+#define STATS_ENABLED_PREF "embedlite.history.stats.enabled"
+
+// Serialize em:history messages on a helper thread
+#define OFFMAINTHREAD_PREF "embedlite.history.json.offmainthread"
+
+// Redirect sources older than this are not part of a new navigation
+#define REDIRECT_TIMEOUT_USEC (30 * PR_USEC_PER_SEC)
+
+/**
+ * em:history message captured on the main thread, serialized wherever
+ * EmbedJSONMessage::Dispatch() runs it. Messages already serialized on
+ * the main thread are set with SetJSON() and only pass through the queue.
+ */
+class HistoryMessage MOZ_FINAL : public EmbedJSONMessage
+{
+public:
+  HistoryMessage(const char* aMsg)
+    : mMsg(aMsg)
+    , mHasURI(false)
+    , mHasTitle(false)
+    , mTransition(nullptr)
+    , mFrecency(0)
+    , mListName(nullptr)
+    , mTitlePairs(false)
+    , mHasJSON(false)
+  {
+  }
+
+  virtual void Write(EmbedJSONWriter& aWriter)
+  {
+    if (mHasJSON) {
+      return;
+    }
+    aWriter.BeginObject();
+    aWriter.StringProperty("msg", nsDependentCString(mMsg));
+    if (mHasURI) {
+      aWriter.StringProperty("uri", mURI);
+    }
+    if (mHasTitle) {
+      aWriter.StringProperty("title", mTitle);
+    }
+    if (mTransition) {
+      aWriter.StringProperty("transition", nsDependentCString(mTransition));
+      aWriter.IntProperty("frecency", mFrecency);
+    }
+    if (mListName) {
+      aWriter.BeginArray(mListName);
+      for (uint32_t i = 0; i < mList.Length(); i++) {
+        if (mTitlePairs) {
+          aWriter.BeginObject();
+          aWriter.StringProperty("uri", mList[i]);
+          aWriter.StringProperty("title", mTitles[i]);
+          aWriter.EndObject();
+        } else {
+          aWriter.StringProperty(nullptr, mList[i]);
+        }
+      }
+      aWriter.EndArray();
+    }
+    aWriter.EndObject();
+  }
+
+  virtual void Deliver(const nsAString& aJSON)
+  {
+    nsCOMPtr<nsIObserverService> observerService =
+      do_GetService(NS_OBSERVERSERVICE_CONTRACTID);
+    if (observerService) {
+      const nsAString& json = mHasJSON ? mJSONString : aJSON;
+      observerService->NotifyObservers(nullptr, "em:history", PromiseFlatString(json).get());
+    }
+  }
+
+  void SetURI(const nsACString& aSpec)
+  {
+    mURI = aSpec;
+    mHasURI = true;
+  }
+
+  void SetTitle(const nsAString& aTitle)
+  {
+    mTitle = aTitle;
+    mHasTitle = true;
+  }
+
+  void SetJSON(const nsAString& aJSON)
+  {
+    mJSONString = aJSON;
+    mHasJSON = true;
+  }
+
+  const char* mMsg;
+  nsCString mURI;
+  bool mHasURI;
+  nsString mTitle;
+  bool mHasTitle;
+  const char* mTransition;
+  int64_t mFrecency;
+  // Array property, of URIs or of {uri, title} objects with mTitles
+  const char* mListName;
+  nsTArray<nsCString> mList;
+  nsTArray<nsString> mTitles;
+  bool mTitlePairs;
+  nsString mJSONString;
+  bool mHasJSON;
+};
+
+static nsresult
+GetVisitedFilterFile(nsIFile** aFile, const char* aName = VISITED_FILTER_FILE)
+{
+  nsCOMPtr<nsIFile> file;
+  nsresult rv = NS_GetSpecialDirectory(NS_APP_USER_PROFILE_50_DIR, getter_AddRefs(file));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = file->AppendNative(nsDependentCString(aName));
+  NS_ENSURE_SUCCESS(rv, rv);
+  file.forget(aFile);
+  return NS_OK;
+}
 
 /*static*/
 EmbedHistoryListener*
 EmbedHistoryListener::GetSingleton()
 {
+  bool created = false;
   if (!sHistory) {
     sHistory = new EmbedHistoryListener();
     NS_ENSURE_TRUE(sHistory, nullptr);
+    created = true;
   }
 
   NS_ADDREF(sHistory);
+  if (created) {
+    // Only once a reference is held, the registration addrefs and
+    // releases the reporter
+    RegisterWeakMemoryReporter(sHistory);
+  }
   return sHistory;
 }
 
 EmbedHistoryListener::EmbedHistoryListener()
+  : mRunScheduled(false)
+  , mVisitedFilterLoaded(false)
+  , mFilterSaveScheduled(false)
+  , mVisitedStoreChecked(false)
+  , mCheckFlushScheduled(false)
+  , mRedirectHead(0)
+  , mDeferredPassScheduled(false)
+  , mDeferredPassDelay(0)
+  , mSerializerShutdown(false)
 {
   nsresult rv;
   nsCOMPtr<nsIObserverService> observerService =
@@ -37,7 +248,136 @@ EmbedHistoryListener::EmbedHistoryListener()
   if (observerService) {
     rv = observerService->AddObserver(this,
                                       "history:notifyVisited", false);
+    rv = observerService->AddObserver(this,
+                                      "history:seedVisited", false);
+    rv = observerService->AddObserver(this,
+                                      "history:removeVisited", false);
+    rv = observerService->AddObserver(this,
+                                      "clear-private-data", false);
+    rv = observerService->AddObserver(this,
+                                      "profile-before-change", false);
+    rv = observerService->AddObserver(this,
+                                      "embedlite-viewport-changed", false);
+    rv = observerService->AddObserver(this,
+                                      "outer-window-destroyed", false);
+    rv = observerService->AddObserver(this,
+                                      "inner-window-destroyed", false);
+    rv = observerService->AddObserver(this,
+                                      "embedlite-history-stats", false);
   }
+
+  Preferences::AddBoolVarCache(&sUsePropertyBag, JSON_PROPERTYBAG_PREF, false);
+  Preferences::AddUintVarCache(&sFrecencyHalfLife, FRECENCY_HALFLIFE_PREF,
+                               FRECENCY_HALFLIFE_DEFAULT);
+  Preferences::AddBoolVarCache(&sLazyVisited, LAZY_VISITED_PREF, false);
+  Preferences::AddBoolVarCache(&sCollectStats, STATS_ENABLED_PREF, false);
+  Preferences::AddBoolVarCache(&sCheckVisitedBatch, CHECKVISITED_BATCH_PREF, false);
+  Preferences::AddUintVarCache(&sTitleDelay, SETTITLE_DELAY_PREF, SETTITLE_DELAY_DEFAULT);
+}
+
+EmbedHistoryListener::~EmbedHistoryListener()
+{
+  UnregisterWeakMemoryReporter(this);
+}
+
+void
+EmbedHistoryListener::EnsureVisitedFilter()
+{
+  if (mVisitedFilterLoaded)
+    return;
+
+  mVisitedFilterLoaded = true;
+  nsCOMPtr<nsIFile> file;
+  if (NS_SUCCEEDED(GetVisitedFilterFile(getter_AddRefs(file)))) {
+    // Missing file is expected on first run, filter stays unseeded then
+    mVisitedFilter.Load(file);
+  }
+
+  nsCOMPtr<nsIFile> dirty;
+  bool exists = false;
+  if (NS_SUCCEEDED(GetVisitedFilterFile(getter_AddRefs(dirty), VISITED_FILTER_DIRTY_FILE)) &&
+      NS_SUCCEEDED(dirty->Exists(&exists)) && exists) {
+    // Visits of the last session were lost, wait for the embedder to seed
+    // the filter again. Marker stays until the unseeded state is saved.
+    mVisitedFilter.SetSeeded(false);
+    VisitedFilterChanged(true);
+  }
+}
+
+void
+EmbedHistoryListener::AddToVisitedFilter(const nsACString& aSpec)
+{
+  EnsureVisitedFilter();
+  bool wasDirty = mVisitedFilter.IsDirty();
+  mVisitedFilter.Add(aSpec);
+  VisitedFilterChanged(wasDirty);
+}
+
+void
+EmbedHistoryListener::VisitedFilterChanged(bool aWasDirty)
+{
+  if (!mVisitedFilter.IsDirty())
+    return;
+
+  if (!aWasDirty) {
+    nsCOMPtr<nsIFile> dirty;
+    if (NS_SUCCEEDED(GetVisitedFilterFile(getter_AddRefs(dirty), VISITED_FILTER_DIRTY_FILE))) {
+      dirty->Create(nsIFile::NORMAL_FILE_TYPE, 0600);
+    }
+  }
+
+  if (mFilterSaveScheduled)
+    return;
+  if (!mFilterSaveTimer) {
+    mFilterSaveTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+  }
+  if (mFilterSaveTimer &&
+      NS_SUCCEEDED(mFilterSaveTimer->InitWithFuncCallback(SaveVisitedFilterCallback, this,
+                                                          VISITED_FILTER_SAVE_DELAY,
+                                                          nsITimer::TYPE_ONE_SHOT))) {
+    mFilterSaveScheduled = true;
+  }
+}
+
+/*static*/
+void
+EmbedHistoryListener::SaveVisitedFilterCallback(nsITimer* aTimer, void* aClosure)
+{
+  static_cast<EmbedHistoryListener*>(aClosure)->SaveVisitedFilter();
+}
+
+void
+EmbedHistoryListener::SaveVisitedFilter()
+{
+  mFilterSaveScheduled = false;
+  if (!mVisitedFilterLoaded || !mVisitedFilter.IsDirty())
+    return;
+
+  nsCOMPtr<nsIFile> file;
+  if (NS_SUCCEEDED(GetVisitedFilterFile(getter_AddRefs(file))) &&
+      NS_SUCCEEDED(mVisitedFilter.Save(file))) {
+    nsCOMPtr<nsIFile> dirty;
+    if (NS_SUCCEEDED(GetVisitedFilterFile(getter_AddRefs(dirty), VISITED_FILTER_DIRTY_FILE))) {
+      dirty->Remove(false);
+    }
+  }
+}
+
+EmbedVisitedStore*
+EmbedHistoryListener::GetVisitedStore()
+{
+  if (!mVisitedStoreChecked) {
+    mVisitedStoreChecked = true;
+    if (Preferences::GetBool(LOCALSTORE_ENABLED_PREF, false)) {
+      nsRefPtr<EmbedVisitedStore> store = new EmbedVisitedStore(this);
+      if (NS_SUCCEEDED(store->Init())) {
+        mVisitedStore = store;
+      } else {
+        store->Shutdown();
+      }
+    }
+  }
+  return mVisitedStore;
 }
 
 NS_IMETHODIMP
@@ -50,54 +390,417 @@ EmbedHistoryListener::RegisterVisitedCallback(nsIURI *aURI, Link *aContent)
   nsresult rv = aURI->GetSpec(uri);
   if (NS_FAILED(rv)) return rv;
 
-  nsTArray<Link*>* list = mListeners.Get(uri);
-  if (!list) {
-    list = new nsTArray<Link*>();
-    mListeners.Put(uri, list);
+  uint64_t hash = EmbedVisitedFilter::HashSpec(uri);
+  EmbedLinkEntry* entry = mListeners.PutEntry(hash);
+  bool alreadyAsked = !entry->IsEmpty() && !entry->IsDeferred();
+  entry->AppendElement(aContent);
+
+  LinkRecord record;
+  record.mWindowID = GetLinkWindowID(aContent);
+  record.mHash = hash;
+  mLinkRecords.Put(aContent, record);
+  if (record.mWindowID) {
+    LinkShard* shard = mShards.Get(record.mWindowID);
+    if (!shard) {
+      shard = new LinkShard();
+      mShards.Put(record.mWindowID, shard);
+    }
+    shard->PutEntry(aContent);
+  }
+  if (sCollectStats) {
+    TimeStamp now = TimeStamp::Now();
+    mStats.LinkRegistered(now);
+    if (entry->RegisteredAt().IsNull()) {
+      entry->SetRegisteredAt(now);
+    }
+  }
+  if (alreadyAsked) {
+    // Visited state of this URI has already been asked for
+    return NS_OK;
   }
-  list->AppendElement(aContent);
 
-  nsString message;
-  // Just simple property bag support still
-  nsCOMPtr<nsIEmbedLiteJSON> json = do_GetService("@mozilla.org/embedlite-json;1");
-  nsCOMPtr<nsIWritablePropertyBag2> root;
-  json->CreateObject(getter_AddRefs(root));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("msg"), NS_LITERAL_CSTRING("checkvisited"));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("uri"), uri);
-
-  json->CreateJSON(root, message);
-  nsCOMPtr<nsIObserverService> observerService =
-    do_GetService(NS_OBSERVERSERVICE_CONTRACTID);
-  // Possible we can avoid json stuff for this case and send uri directly
-  if (observerService) {
-    observerService->NotifyObservers(nullptr, "em:history", message.get());
+  if (CanDeferLink(aContent)) {
+    // Layout may not exist yet while links are bound. The link is measured
+    // on the next tick and only stays deferred if it is off screen.
+    DeferredLink deferred;
+    deferred.mHash = hash;
+    deferred.mMeasured = false;
+    deferred.mReflows = 0;
+    mDeferredLinks.Put(aContent, deferred);
+    entry->SetDeferred(true);
+    ScheduleDeferredPass(0);
+    return NS_OK;
   }
 
+  entry->SetDeferred(false);
+  ResolveVisitedState(uri);
   return NS_OK;
 }
 
+void
+EmbedHistoryListener::ResolveVisitedState(const nsACString& aSpec)
+{
+  // The filter has no false negatives once seeded with the embedder's
+  // history, so an unknown URI can be answered locally. Link stays
+  // registered in case it gets visited later.
+  EnsureVisitedFilter();
+  if (mVisitedFilter.IsSeeded() && !mVisitedFilter.MightContain(aSpec))
+    return;
+
+  EmbedVisitedStore* store = GetVisitedStore();
+  if (store) {
+    store->LookupVisited(aSpec);
+  } else {
+    QueueVisitedCheck(aSpec);
+  }
+}
+
+bool
+EmbedHistoryListener::CanDeferLink(Link* aLink)
+{
+  if (!sLazyVisited)
+    return false;
+
+  Element* element = aLink->GetElement();
+  nsIDocument* doc = element ? element->OwnerDoc() : nullptr;
+  nsPIDOMWindow* window = doc ? doc->GetWindow() : nullptr;
+
+  // Viewports are only known for top level windows, links in frames
+  // and windows without a viewport update yet are resolved right away
+  return window && mViewports.Get(window->WindowID(), nullptr);
+}
+
+/* Whether a deferred link is still outside the viewport band. Layout of
+ * each window is flushed once per pass, aReflows keeps its reflow count,
+ * and a link is only measured again once its document has reflowed.
+ */
+bool
+EmbedHistoryListener::IsLinkOffscreen(Link* aLink, DeferredLink& aDeferred,
+                                      WindowReflows& aReflows)
+{
+  Element* element = aLink->GetElement();
+  nsIDocument* doc = element ? element->OwnerDoc() : nullptr;
+  nsPIDOMWindow* window = doc ? doc->GetWindow() : nullptr;
+  gfx::Rect viewport;
+  if (!window || !mViewports.Get(window->WindowID(), &viewport))
+    return false;
+
+  uint64_t reflows;
+  if (!aReflows.Get(window, &reflows)) {
+    nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(window);
+    doc->FlushPendingNotifications(Flush_Layout);
+    if (!utils || NS_FAILED(utils->GetFramesReflowed(&reflows)))
+      return false;
+    aReflows.Put(window, reflows);
+  }
+
+  if (!aDeferred.mMeasured || aDeferred.mReflows != reflows) {
+    // Links without a box never come into view, no point in holding them back
+    if (!element->GetPrimaryFrame())
+      return false;
+
+    nsRefPtr<DOMRect> rect = element->GetBoundingClientRect();
+    if (!rect || (rect->Width() <= 0 && rect->Height() <= 0))
+      return false;
+
+    int32_t scrollX = 0, scrollY = 0;
+    window->GetScrollX(&scrollX);
+    window->GetScrollY(&scrollY);
+    aDeferred.mRect = gfx::Rect(rect->Left() + scrollX, rect->Top() + scrollY,
+                                rect->Width(), rect->Height());
+    aDeferred.mReflows = reflows;
+    aDeferred.mMeasured = true;
+  }
+
+  gfx::Rect band(viewport);
+  band.Inflate(viewport.width * LAZY_VISITED_BAND, viewport.height * LAZY_VISITED_BAND);
+  return !band.Intersects(aDeferred.mRect);
+}
+
+void
+EmbedHistoryListener::ScheduleDeferredPass(uint32_t aDelay)
+{
+  if (mDeferredPassScheduled && mDeferredPassDelay <= aDelay)
+    return;
+
+  if (!mDeferredTimer) {
+    mDeferredTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+  }
+  NS_ENSURE_TRUE(mDeferredTimer, );
+  if (NS_SUCCEEDED(mDeferredTimer->InitWithFuncCallback(ResolveDeferredLinksCallback, this,
+                                                        aDelay, nsITimer::TYPE_ONE_SHOT))) {
+    mDeferredPassScheduled = true;
+    mDeferredPassDelay = aDelay;
+  }
+}
+
+/*static*/
+void
+EmbedHistoryListener::ResolveDeferredLinksCallback(nsITimer* aTimer, void* aClosure)
+{
+  static_cast<EmbedHistoryListener*>(aClosure)->ResolveDeferredLinks();
+}
+
+/*static*/ PLDHashOperator
+EmbedHistoryListener::CollectDeferredLink(Link* aLink, DeferredLink aDeferred, void* aClosure)
+{
+  static_cast<nsTArray<Link*>*>(aClosure)->AppendElement(aLink);
+  return PL_DHASH_NEXT;
+}
+
+void
+EmbedHistoryListener::ResolveDeferredLinks()
+{
+  mDeferredPassScheduled = false;
+
+  // Resolving may notify the embedder, which can answer synchronously and
+  // unregister links, so the table is only read through a snapshot
+  nsTArray<Link*> links(mDeferredLinks.Count());
+  mDeferredLinks.EnumerateRead(CollectDeferredLink, &links);
+
+  WindowReflows reflows;
+  nsTArray<nsCString> resolved;
+  for (uint32_t i = 0; i < links.Length(); i++) {
+    Link* link = links[i];
+    DeferredLink deferred;
+    if (!mDeferredLinks.Get(link, &deferred))
+      continue;
+
+    // URI already asked for through another link
+    EmbedLinkEntry* entry = mListeners.GetEntry(deferred.mHash);
+    if (!entry || !entry->IsDeferred()) {
+      mDeferredLinks.Remove(link);
+      continue;
+    }
+    if (IsLinkOffscreen(link, deferred, reflows)) {
+      mDeferredLinks.Put(link, deferred);
+      continue;
+    }
+
+    mDeferredLinks.Remove(link);
+    entry->SetDeferred(false);
+    nsCOMPtr<nsIURI> linkURI = link->GetURI();
+    nsCString* spec = resolved.AppendElement();
+    if (!linkURI || NS_FAILED(linkURI->GetSpec(*spec))) {
+      resolved.RemoveElementAt(resolved.Length() - 1);
+    }
+  }
+
+  for (uint32_t i = 0; i < resolved.Length(); i++) {
+    ResolveVisitedState(resolved[i]);
+  }
+}
+
+void
+EmbedHistoryListener::OnVisitedLookup(const nsTArray<nsCString>& aVisited,
+                                      const nsTArray<nsCString>& aMissed)
+{
+  // Already running from a runnable of its own, no need to go through Run()
+  MarkLinksVisited(aVisited);
+
+  // Local store only knows visits made since it was enabled, so the
+  // embedder still has the last word on misses
+  for (uint32_t i = 0; i < aMissed.Length(); i++) {
+    QueueVisitedCheck(aMissed[i]);
+  }
+}
+
+void
+EmbedHistoryListener::QueueVisitedCheck(const nsACString& aSpec)
+{
+  if (!sCheckVisitedBatch) {
+    SendURIMessage("checkvisited", aSpec);
+    return;
+  }
+
+  mPendingChecks.AppendElement(aSpec);
+  if (mCheckFlushScheduled)
+    return;
+
+  mCheckFlushScheduled = true;
+  uint32_t delay = Preferences::GetUint(CHECKVISITED_DELAY_PREF, 0);
+  if (delay) {
+    if (!mCheckTimer) {
+      mCheckTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+    }
+    if (mCheckTimer &&
+        NS_SUCCEEDED(mCheckTimer->InitWithFuncCallback(FlushVisitedChecksCallback, this,
+                                                       delay, nsITimer::TYPE_ONE_SHOT))) {
+      return;
+    }
+  }
+  NS_DispatchToMainThread(NS_NewRunnableMethod(this, &EmbedHistoryListener::FlushVisitedChecks));
+}
+
+/*static*/
+void
+EmbedHistoryListener::FlushVisitedChecksCallback(nsITimer* aTimer, void* aClosure)
+{
+  static_cast<EmbedHistoryListener*>(aClosure)->FlushVisitedChecks();
+}
+
+void
+EmbedHistoryListener::FlushVisitedChecks()
+{
+  mCheckFlushScheduled = false;
+  if (mPendingChecks.IsEmpty())
+    return;
+
+  if (mPendingChecks.Length() == 1) {
+    // Keep the single link case compatible with older embedders
+    SendURIMessage("checkvisited", mPendingChecks[0]);
+    mPendingChecks.Clear();
+    return;
+  }
+
+  nsRefPtr<HistoryMessage> message = new HistoryMessage("checkvisitedbatch");
+  message->mListName = "uris";
+  message->mList.SwapElements(mPendingChecks);
+  message->Dispatch(GetSerializerThread());
+}
+
+nsIThread*
+EmbedHistoryListener::GetSerializerThread()
+{
+  if (!mSerializerThread && !mSerializerShutdown &&
+      Preferences::GetBool(OFFMAINTHREAD_PREF, false)) {
+    NS_NewNamedThread("HistoryJSON", getter_AddRefs(mSerializerThread));
+  }
+  return mSerializerThread;
+}
+
+void
+EmbedHistoryListener::SendURIMessage(const char* aMsg, const nsACString& aSpec,
+                                     const nsAString* aTitle)
+{
+  if (sUsePropertyBag) {
+    nsString message;
+    nsCOMPtr<nsIEmbedLiteJSON> json = do_GetService("@mozilla.org/embedlite-json;1");
+    nsCOMPtr<nsIWritablePropertyBag2> root;
+    json->CreateObject(getter_AddRefs(root));
+    root->SetPropertyAsACString(NS_LITERAL_STRING("msg"), nsDependentCString(aMsg));
+    root->SetPropertyAsACString(NS_LITERAL_STRING("uri"), aSpec);
+    if (aTitle) {
+      root->SetPropertyAsAString(NS_LITERAL_STRING("title"), *aTitle);
+    }
+    json->CreateJSON(root, message);
+    NotifyHistoryMessage(message);
+    return;
+  }
+
+  nsRefPtr<HistoryMessage> uriMessage = new HistoryMessage(aMsg);
+  uriMessage->SetURI(aSpec);
+  if (aTitle) {
+    uriMessage->SetTitle(*aTitle);
+  }
+  uriMessage->Dispatch(GetSerializerThread());
+}
+
+void
+EmbedHistoryListener::SendStats()
+{
+  nsString message;
+  EmbedJSONWriter writer(message);
+  writer.BeginObject();
+  writer.StringProperty("msg", NS_LITERAL_CSTRING("stats"));
+  mStats.WriteJSON(writer);
+  writer.IntProperty("linkEntries", mListeners.Count());
+  writer.IntProperty("deferredLinks", mDeferredLinks.Count());
+  writer.IntProperty("pendingQueue", mPendingURIs.Length() + mPendingChecks.Length());
+  writer.EndObject();
+  NotifyHistoryMessage(message);
+}
+
+void
+EmbedHistoryListener::NotifyHistoryMessage(const nsAString& aMessage)
+{
+  // Goes through the serializer queue as well, so that it is not
+  // delivered ahead of messages dispatched before it
+  nsRefPtr<HistoryMessage> message = new HistoryMessage(nullptr);
+  message->SetJSON(aMessage);
+  message->Dispatch(GetSerializerThread());
+}
+
 NS_IMETHODIMP
 EmbedHistoryListener::UnregisterVisitedCallback(nsIURI *aURI, Link *aContent)
 {
-  if (!aContent || !aURI)
+  if (!aContent)
     return NS_OK;
 
-  nsAutoCString uri;
-  nsresult rv = aURI->GetSpec(uri);
-  if (NS_FAILED(rv)) return rv;
+  // Links already notified or dropped with their window have no record
+  uint64_t hash;
+  if (!ForgetLink(aContent, &hash))
+    return NS_OK;
 
-  nsTArray<Link*>* list = mListeners.Get(uri);
-  if (!list)
+  EmbedLinkEntry* entry = mListeners.GetEntry(hash);
+  if (!entry)
     return NS_OK;
 
-  list->RemoveElement(aContent);
-  if (list->IsEmpty()) {
-    mListeners.Remove(uri);
-    delete list;
+  entry->RemoveElement(aContent);
+  if (entry->IsEmpty()) {
+    mListeners.RemoveEntry(hash);
   }
   return NS_OK;
 }
 
+uint64_t
+EmbedHistoryListener::GetLinkWindowID(Link* aLink)
+{
+  Element* element = aLink->GetElement();
+  return element ? element->OwnerDoc()->InnerWindowID() : 0;
+}
+
+bool
+EmbedHistoryListener::ForgetLink(Link* aLink, uint64_t* aHash)
+{
+  LinkRecord record;
+  if (!mLinkRecords.Get(aLink, &record))
+    return false;
+
+  mLinkRecords.Remove(aLink);
+  mDeferredLinks.Remove(aLink);
+  LinkShard* shard = record.mWindowID ? mShards.Get(record.mWindowID) : nullptr;
+  if (shard) {
+    shard->RemoveEntry(aLink);
+  }
+  *aHash = record.mHash;
+  return true;
+}
+
+/*static*/ PLDHashOperator
+EmbedHistoryListener::DropShardLink(nsPtrHashKey<Link>* aEntry, void* aClosure)
+{
+  EmbedHistoryListener* history = static_cast<EmbedHistoryListener*>(aClosure);
+  Link* link = aEntry->GetKey();
+  LinkRecord record;
+  if (!history->mLinkRecords.Get(link, &record))
+    return PL_DHASH_NEXT;
+
+  history->mLinkRecords.Remove(link);
+  history->mDeferredLinks.Remove(link);
+  EmbedLinkEntry* entry = history->mListeners.GetEntry(record.mHash);
+  if (entry) {
+    entry->RemoveElement(link);
+    if (entry->IsEmpty()) {
+      history->mListeners.RemoveEntry(record.mHash);
+    }
+  }
+  return PL_DHASH_NEXT;
+}
+
+void
+EmbedHistoryListener::DropShard(uint64_t aWindowID)
+{
+  LinkShard* shard = mShards.Get(aWindowID);
+  if (!shard)
+    return;
+
+  // Links of a destroyed window must not be notified, those still alive
+  // find no record when they unregister later
+  shard->EnumerateEntries(DropShardLink, this);
+  mShards.Remove(aWindowID);
+}
+
 NS_IMETHODIMP
 EmbedHistoryListener::VisitURI(nsIURI *aURI, nsIURI *aLastVisitedURI, uint32_t aFlags)
 {
@@ -107,9 +810,6 @@ EmbedHistoryListener::VisitURI(nsIURI *aURI, nsIURI *aLastVisitedURI, uint32_t a
   if (!(aFlags & VisitFlags::TOP_LEVEL))
     return NS_OK;
 
-  if (aFlags & VisitFlags::REDIRECT_SOURCE)
-    return NS_OK;
-
   if (aFlags & VisitFlags::UNRECOVERABLE_ERROR)
     return NS_OK;
 
@@ -117,24 +817,157 @@ EmbedHistoryListener::VisitURI(nsIURI *aURI, nsIURI *aLastVisitedURI, uint32_t a
   nsresult rv = aURI->GetSpec(uri);
   if (NS_FAILED(rv)) return rv;
 
-  nsString message;
-  // Just simple property bag support still
-  nsCOMPtr<nsIEmbedLiteJSON> json = do_GetService("@mozilla.org/embedlite-json;1");
-  nsCOMPtr<nsIWritablePropertyBag2> root;
-  json->CreateObject(getter_AddRefs(root));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("msg"), NS_LITERAL_CSTRING("markvisited"));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("uri"), uri);
-
-  json->CreateJSON(root, message);
-  nsCOMPtr<nsIObserverService> observerService =
-    do_GetService(NS_OBSERVERSERVICE_CONTRACTID);
-  if (observerService) {
-    observerService->NotifyObservers(nullptr, "em:history", message.get());
+  nsAutoCString lastVisited;
+  if (aLastVisitedURI) {
+    aLastVisitedURI->GetSpec(lastVisited);
+  }
+
+  if (aFlags & VisitFlags::REDIRECT_SOURCE) {
+    // Reported along with the URI the navigation ends up on
+    RememberRedirectSource(uri, lastVisited);
+    return NS_OK;
+  }
+
+  const char* transition = lastVisited.IsEmpty() ? "direct" : "link";
+  nsTArray<nsCString> redirects;
+  nsAutoCString origin(lastVisited);
+  if (aFlags & (VisitFlags::REDIRECT_PERMANENT | VisitFlags::REDIRECT_TEMPORARY)) {
+    transition = (aFlags & VisitFlags::REDIRECT_PERMANENT) ?
+                 "redirect_permanent" : "redirect_temporary";
+    CollectRedirectChain(lastVisited, redirects, origin);
   }
 
+  // Score the final URI by how the user started the navigation
+  double frecency = UpdateFrecency(uri, origin.IsEmpty() ? FRECENCY_WEIGHT_DIRECT
+                                                         : FRECENCY_WEIGHT_LINK);
+
+  AddToVisitedFilter(uri);
+
+  EmbedVisitedStore* store = GetVisitedStore();
+  if (store) {
+    store->RecordVisit(uri);
+  }
+
+  SendVisit(uri, transition, frecency, redirects);
   return NS_OK;
 }
 
+void
+EmbedHistoryListener::RememberRedirectSource(const nsACString& aSpec,
+                                             const nsACString& aReferrer)
+{
+  RedirectSource& source = mRedirects[mRedirectHead];
+  source.mSpec = aSpec;
+  source.mReferrer = aReferrer;
+  source.mTime = PR_Now();
+  mRedirectHead = (mRedirectHead + 1) % REDIRECT_RING_SIZE;
+}
+
+void
+EmbedHistoryListener::CollectRedirectChain(const nsACString& aLastVisited,
+                                           nsTArray<nsCString>& aChain,
+                                           nsACString& aOrigin)
+{
+  PRTime now = PR_Now();
+  nsAutoCString hop(aLastVisited);
+  // Walk back from the last hop, newest sources first
+  while (!hop.IsEmpty() && aChain.Length() < REDIRECT_RING_SIZE) {
+    RedirectSource* found = nullptr;
+    for (uint32_t i = 1; i <= REDIRECT_RING_SIZE; i++) {
+      RedirectSource& source =
+        mRedirects[(mRedirectHead + REDIRECT_RING_SIZE - i) % REDIRECT_RING_SIZE];
+      if (!source.mSpec.IsEmpty() && source.mSpec.Equals(hop) &&
+          now - source.mTime < REDIRECT_TIMEOUT_USEC) {
+        found = &source;
+        break;
+      }
+    }
+    if (!found)
+      break;
+
+    aChain.InsertElementAt(0, found->mSpec);
+    hop = found->mReferrer;
+    found->mSpec.Truncate();
+    found->mReferrer.Truncate();
+  }
+  aOrigin = hop;
+}
+
+/*static*/ double
+EmbedHistoryListener::DecayFrecency(const FrecencyEntry& aEntry, PRTime aNow)
+{
+  if (!sFrecencyHalfLife || aNow <= aEntry.mLastVisit)
+    return aEntry.mScore;
+
+  double halfLife = double(sFrecencyHalfLife) * 3600 * PR_USEC_PER_SEC;
+  return aEntry.mScore * pow(0.5, double(aNow - aEntry.mLastVisit) / halfLife);
+}
+
+double
+EmbedHistoryListener::UpdateFrecency(const nsACString& aSpec, uint32_t aWeight)
+{
+  PRTime now = PR_Now();
+  FrecencyEntry entry = { 0, now };
+  mFrecency.Get(aSpec, &entry);
+  entry.mScore = DecayFrecency(entry, now) + aWeight;
+  entry.mLastVisit = now;
+  mFrecency.Put(aSpec, entry);
+
+  if (mFrecency.Count() > FRECENCY_MAX_ENTRIES) {
+    PruneFrecency(now);
+  }
+  return entry.mScore;
+}
+
+struct FrecencyPruneClosure
+{
+  PRTime mNow;
+  double mThreshold;
+};
+
+/*static*/ PLDHashOperator
+EmbedHistoryListener::PruneFrecencyEntry(const nsACString& aKey,
+                                         FrecencyEntry& aEntry,
+                                         void* aClosure)
+{
+  FrecencyPruneClosure* closure = static_cast<FrecencyPruneClosure*>(aClosure);
+  if (DecayFrecency(aEntry, closure->mNow) < closure->mThreshold)
+    return PL_DHASH_REMOVE;
+  return PL_DHASH_NEXT;
+}
+
+void
+EmbedHistoryListener::PruneFrecency(PRTime aNow)
+{
+  // Raise the bar until a quarter of the table is free again, so that
+  // pruning does not run on every visit of a full table
+  FrecencyPruneClosure closure = { aNow, FRECENCY_PRUNE_SCORE };
+  while (mFrecency.Count() > FRECENCY_MAX_ENTRIES * 3 / 4) {
+    mFrecency.Enumerate(PruneFrecencyEntry, &closure);
+    closure.mThreshold *= 2;
+  }
+}
+
+void
+EmbedHistoryListener::SendVisit(const nsACString& aSpec, const char* aTransition,
+                                double aFrecency, const nsTArray<nsCString>& aRedirects)
+{
+  if (sUsePropertyBag) {
+    SendURIMessage("markvisited", aSpec);
+    return;
+  }
+
+  nsRefPtr<HistoryMessage> message = new HistoryMessage("markvisited");
+  message->SetURI(aSpec);
+  message->mTransition = aTransition;
+  message->mFrecency = int64_t(aFrecency + 0.5);
+  if (!aRedirects.IsEmpty()) {
+    message->mListName = "redirects";
+    message->mList = aRedirects;
+  }
+  message->Dispatch(GetSerializerThread());
+}
+
 nsIEmbedAppService*
 EmbedHistoryListener::GetService()
 {
@@ -150,35 +983,206 @@ EmbedHistoryListener::SetURITitle(nsIURI *aURI, const nsAString& aTitle)
   if (!aURI)
     return NS_OK;
 
-  // we don't do anything with this right now
   nsAutoCString uri;
   nsresult rv = aURI->GetSpec(uri);
   if (NS_FAILED(rv)) return rv;
-  nsCOMPtr<nsIObserverService> observerService =
-    do_GetService(NS_OBSERVERSERVICE_CONTRACTID);
-  nsString message;
-  // Just simple property bag support still
-  nsCOMPtr<nsIEmbedLiteJSON> json = do_GetService("@mozilla.org/embedlite-json;1");
-  nsCOMPtr<nsIWritablePropertyBag2> root;
-  json->CreateObject(getter_AddRefs(root));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("msg"), NS_LITERAL_CSTRING("settitle"));
-  root->SetPropertyAsACString(NS_LITERAL_STRING("uri"), uri);
-  root->SetPropertyAsAString(NS_LITERAL_STRING("title"), aTitle);
-  json->CreateJSON(root, message);
-  if (observerService) {
-    observerService->NotifyObservers(nullptr, "em:history", message.get());
+
+  if (!sTitleDelay) {
+    SendTitle(uri, aTitle);
+    return NS_OK;
+  }
+
+  // Only the last title within the interval is sent
+  bool isNew = !mPendingTitles.Get(uri, nullptr);
+  mPendingTitles.Put(uri, nsString(aTitle));
+  if (!isNew)
+    return NS_OK;
+
+  mTitleURIs.AppendElement(uri);
+  if (mTitleURIs.Length() == 1) {
+    if (!mTitleTimer) {
+      mTitleTimer = do_CreateInstance(NS_TIMER_CONTRACTID);
+    }
+    if (!mTitleTimer ||
+        NS_FAILED(mTitleTimer->InitWithFuncCallback(FlushTitlesCallback, this,
+                                                    sTitleDelay, nsITimer::TYPE_ONE_SHOT))) {
+      FlushTitles();
+    }
   }
   return NS_OK;
 }
 
+/*static*/
+void
+EmbedHistoryListener::FlushTitlesCallback(nsITimer* aTimer, void* aClosure)
+{
+  static_cast<EmbedHistoryListener*>(aClosure)->FlushTitles();
+}
+
+void
+EmbedHistoryListener::FlushTitles()
+{
+  if (mTitleURIs.IsEmpty())
+    return;
+
+  nsTArray<nsCString> uris;
+  uris.SwapElements(mTitleURIs);
+
+  if (uris.Length() == 1) {
+    nsString title;
+    mPendingTitles.Get(uris[0], &title);
+    mPendingTitles.Clear();
+    SendTitle(uris[0], title);
+    return;
+  }
+
+  EmbedVisitedStore* store = GetVisitedStore();
+  nsRefPtr<HistoryMessage> message = new HistoryMessage("settitlebatch");
+  message->mListName = "titles";
+  message->mTitlePairs = true;
+  message->mTitles.SetCapacity(uris.Length());
+  for (uint32_t i = 0; i < uris.Length(); i++) {
+    nsString* title = message->mTitles.AppendElement();
+    mPendingTitles.Get(uris[i], title);
+    if (store) {
+      store->SetTitle(uris[i], *title);
+    }
+  }
+  message->mList.SwapElements(uris);
+  mPendingTitles.Clear();
+
+  message->Dispatch(GetSerializerThread());
+}
+
+void
+EmbedHistoryListener::SendTitle(const nsACString& aSpec, const nsAString& aTitle)
+{
+  EmbedVisitedStore* store = GetVisitedStore();
+  if (store) {
+    store->SetTitle(aSpec, aTitle);
+  }
+
+  SendURIMessage("settitle", aSpec, &aTitle);
+}
+
 NS_IMETHODIMP
 EmbedHistoryListener::Observe(nsISupports *aSubject,
                               const char *aTopic,
                               const char16_t *aData)
 {
   if (!strcmp(aTopic, "history:notifyVisited")) {
-    sHistory->mPendingURIs.Push(NS_ConvertUTF16toUTF8(aData));
-    NS_DispatchToMainThread(sHistory);
+    // Answers to checkvisitedbatch carry newline separated URIs
+    NS_ConvertUTF16toUTF8 uris(aData);
+    nsCCharSeparatedTokenizer tokenizer(uris, '\n');
+    while (tokenizer.hasMoreTokens()) {
+      const nsCSubstring& uri = tokenizer.nextToken();
+      if (uri.IsEmpty())
+        continue;
+      AddToVisitedFilter(uri);
+      QueueVisitedNotification(uri);
+    }
+  } else if (!strcmp(aTopic, "history:seedVisited")) {
+    // The embedder's whole history as newline separated URIs, in as many
+    // notifications as it likes. One without data ends the seed and lets
+    // the filter answer misses.
+    EnsureVisitedFilter();
+    bool wasDirty = mVisitedFilter.IsDirty();
+    if (aData && *aData) {
+      NS_ConvertUTF16toUTF8 uris(aData);
+      nsCCharSeparatedTokenizer tokenizer(uris, '\n');
+      while (tokenizer.hasMoreTokens()) {
+        const nsCSubstring& uri = tokenizer.nextToken();
+        if (!uri.IsEmpty()) {
+          mVisitedFilter.Add(uri);
+        }
+      }
+    } else {
+      mVisitedFilter.SetSeeded(true);
+    }
+    VisitedFilterChanged(wasDirty);
+  } else if (!strcmp(aTopic, "history:removeVisited")) {
+    // Newline separated URIs the embedder dropped from its history, the
+    // local store must stop answering them as visited
+    if (aData && GetVisitedStore()) {
+      NS_ConvertUTF16toUTF8 uris(aData);
+      nsCCharSeparatedTokenizer tokenizer(uris, '\n');
+      while (tokenizer.hasMoreTokens()) {
+        const nsCSubstring& uri = tokenizer.nextToken();
+        if (!uri.IsEmpty()) {
+          mVisitedStore->RemoveVisit(uri);
+        }
+      }
+    }
+  } else if (!strcmp(aTopic, "clear-private-data")) {
+    if (aData && NS_LITERAL_STRING("history").Equals(aData)) {
+      // Drop bits of visits the embedder has just forgotten about
+      EnsureVisitedFilter();
+      bool wasDirty = mVisitedFilter.IsDirty();
+      mVisitedFilter.Clear();
+      VisitedFilterChanged(wasDirty);
+      if (GetVisitedStore()) {
+        mVisitedStore->Clear();
+      }
+      mFrecency.Clear();
+      for (uint32_t i = 0; i < REDIRECT_RING_SIZE; i++) {
+        mRedirects[i].mSpec.Truncate();
+        mRedirects[i].mReferrer.Truncate();
+      }
+    }
+  } else if (!strcmp(aTopic, "embedlite-viewport-changed")) {
+    // Data is the CSS composited rect of the window as "x,y,width,height"
+    nsCOMPtr<nsPIDOMWindow> window = do_QueryInterface(aSubject);
+    float x, y, width, height;
+    if (window && aData &&
+        sscanf(NS_ConvertUTF16toUTF8(aData).get(), "%f,%f,%f,%f",
+               &x, &y, &width, &height) == 4) {
+      mViewports.Put(window->WindowID(), gfx::Rect(x, y, width, height));
+      if (mDeferredLinks.Count()) {
+        ScheduleDeferredPass(LAZY_VISITED_PASS_DELAY);
+      }
+    }
+  } else if (!strcmp(aTopic, "outer-window-destroyed")) {
+    nsCOMPtr<nsISupportsPRUint64> wrapper = do_QueryInterface(aSubject);
+    uint64_t windowID = 0;
+    if (wrapper && NS_SUCCEEDED(wrapper->GetData(&windowID))) {
+      mViewports.Remove(windowID);
+    }
+  } else if (!strcmp(aTopic, "inner-window-destroyed")) {
+    nsCOMPtr<nsISupportsPRUint64> wrapper = do_QueryInterface(aSubject);
+    uint64_t windowID = 0;
+    if (wrapper && NS_SUCCEEDED(wrapper->GetData(&windowID))) {
+      DropShard(windowID);
+    }
+  } else if (!strcmp(aTopic, "embedlite-history-stats")) {
+    // Answered with a "stats" message, "reset" starts a new measurement
+    if (aData && NS_LITERAL_STRING("reset").Equals(aData)) {
+      mStats.Reset();
+    } else {
+      SendStats();
+    }
+  } else if (!strcmp(aTopic, "profile-before-change")) {
+    if (mTitleTimer) {
+      mTitleTimer->Cancel();
+    }
+    if (mDeferredTimer) {
+      mDeferredTimer->Cancel();
+      mDeferredPassScheduled = false;
+    }
+    if (mFilterSaveTimer) {
+      mFilterSaveTimer->Cancel();
+    }
+    FlushTitles();
+    SaveVisitedFilter();
+    // Delivers whatever is still being serialized
+    mSerializerShutdown = true;
+    if (mSerializerThread) {
+      mSerializerThread->Shutdown();
+      mSerializerThread = nullptr;
+    }
+    if (mVisitedStore) {
+      mVisitedStore->Shutdown();
+      mVisitedStore = nullptr;
+    }
   }
   return NS_OK;
 }
@@ -189,29 +1193,198 @@ EmbedHistoryListener::NotifyVisited(nsIURI *aURI)
   if (aURI && sHistory) {
     nsAutoCString spec;
     (void)aURI->GetSpec(spec);
-    sHistory->mPendingURIs.Push(spec);
-    NS_DispatchToMainThread(sHistory);
+    sHistory->AddToVisitedFilter(spec);
+    sHistory->QueueVisitedNotification(spec);
+  }
+
+  return NS_OK;
+}
+
+void
+EmbedHistoryListener::QueueVisitedNotification(const nsACString& aSpec)
+{
+  if (mPendingURISet.Contains(aSpec))
+    return;
+
+  mPendingURISet.PutEntry(aSpec);
+  mPendingURIs.AppendElement(aSpec);
+  if (!mRunScheduled) {
+    mRunScheduled = true;
+    NS_DispatchToMainThread(this);
+  }
+}
+
+MOZ_DEFINE_MALLOC_SIZE_OF(EmbedHistoryMallocSizeOf)
+
+struct LinkTableStats
+{
+  uint32_t entries;
+  uint32_t linkSlots;
+};
+
+static size_t
+SizeOfShardExcludingThis(const uint64_t& aKey,
+                         const nsAutoPtr<nsTHashtable<nsPtrHashKey<Link> > >& aShard,
+                         MallocSizeOf aMallocSizeOf, void* aArg)
+{
+  return aMallocSizeOf(aShard.get()) +
+         aShard->SizeOfExcludingThis(nullptr, aMallocSizeOf);
+}
+
+static size_t
+SizeOfLinkEntryExcludingThis(EmbedLinkEntry* aEntry, MallocSizeOf aMallocSizeOf, void* aArg)
+{
+  LinkTableStats* stats = static_cast<LinkTableStats*>(aArg);
+  stats->entries++;
+  stats->linkSlots += aEntry->Length();
+  return aEntry->SizeOfExcludingThis(aMallocSizeOf);
+}
+
+#define REPORT(_path, _kind, _units, _amount, _desc)                          \
+  do {                                                                        \
+    nsresult rv;                                                              \
+    rv = aHandleReport->Callback(EmptyCString(), NS_LITERAL_CSTRING(_path),   \
+                                 _kind, _units, _amount,                      \
+                                 NS_LITERAL_CSTRING(_desc), aData);           \
+    NS_ENSURE_SUCCESS(rv, rv);                                                \
+  } while (0)
+
+NS_IMETHODIMP
+EmbedHistoryListener::CollectReports(nsIMemoryReporterCallback* aHandleReport,
+                                     nsISupports* aData)
+{
+  LinkTableStats stats = { 0, 0 };
+  size_t tableSize = mListeners.SizeOfExcludingThis(SizeOfLinkEntryExcludingThis,
+                                                    EmbedHistoryMallocSizeOf, &stats);
+  tableSize += mShards.SizeOfExcludingThis(SizeOfShardExcludingThis,
+                                           EmbedHistoryMallocSizeOf);
+  tableSize += mLinkRecords.SizeOfExcludingThis(nullptr, EmbedHistoryMallocSizeOf);
+
+  size_t pendingSize = mPendingURIs.SizeOfExcludingThis(EmbedHistoryMallocSizeOf) +
+                       mDeferredLinks.SizeOfExcludingThis(nullptr, EmbedHistoryMallocSizeOf) +
+                       mPendingChecks.SizeOfExcludingThis(EmbedHistoryMallocSizeOf) +
+                       mPendingURISet.SizeOfExcludingThis(nullptr, EmbedHistoryMallocSizeOf);
+  for (uint32_t i = 0; i < mPendingURIs.Length(); i++) {
+    pendingSize += mPendingURIs[i].SizeOfExcludingThisIfUnshared(EmbedHistoryMallocSizeOf);
+  }
+  for (uint32_t i = 0; i < mPendingChecks.Length(); i++) {
+    pendingSize += mPendingChecks[i].SizeOfExcludingThisIfUnshared(EmbedHistoryMallocSizeOf);
+  }
+
+  REPORT("explicit/embedlite/history/link-table", KIND_HEAP, UNITS_BYTES, tableSize,
+         "Memory used by the table of links waiting for their visited state.");
+
+  REPORT("explicit/embedlite/history/pending-uris", KIND_HEAP, UNITS_BYTES, pendingSize,
+         "Memory used by URIs queued for visited checks and notifications.");
+
+  REPORT("explicit/embedlite/history/visited-filter", KIND_HEAP, UNITS_BYTES,
+         mVisitedFilter.SizeOfExcludingThis(EmbedHistoryMallocSizeOf),
+         "Memory used by the Bloom filter of visited URIs.");
+
+  REPORT("explicit/embedlite/history/frecency-table", KIND_HEAP, UNITS_BYTES,
+         mFrecency.SizeOfExcludingThis(nullptr, EmbedHistoryMallocSizeOf),
+         "Memory used by the table of per-URI frecency scores.");
+
+  REPORT("explicit/embedlite/history/stats", KIND_HEAP, UNITS_BYTES,
+         mStats.SizeOfExcludingThis(EmbedHistoryMallocSizeOf),
+         "Memory used by latency samples of the history stats.");
+
+  REPORT("embedlite-history-link-entries", KIND_OTHER, UNITS_COUNT, stats.entries,
+         "Number of distinct URIs with registered links.");
+
+  REPORT("embedlite-history-link-slots", KIND_OTHER, UNITS_COUNT, stats.linkSlots,
+         "Number of registered links. A value that keeps growing on a long lived "
+         "tab points to links that are never unregistered.");
+
+  REPORT("embedlite-history-key-bytes", KIND_OTHER, UNITS_BYTES,
+         stats.entries * sizeof(uint64_t),
+         "Bytes used by the URI hash keys of the link table.");
+
+  REPORT("embedlite-history-pending-queue", KIND_OTHER, UNITS_COUNT,
+         mPendingURIs.Length() + mPendingChecks.Length(),
+         "Number of URIs waiting to be checked or notified as visited.");
+
+  REPORT("embedlite-history-deferred-links", KIND_OTHER, UNITS_COUNT,
+         mDeferredLinks.Count(),
+         "Number of off screen links whose visited check waits for the viewport "
+         "to come near them.");
+
+  if (mVisitedStore) {
+    REPORT("embedlite-history-lookup-queue-depth", KIND_OTHER, UNITS_COUNT,
+           mVisitedStore->LookupQueueDepth(),
+           "Number of URIs queued for the local visited store lookup thread.");
+
+    REPORT("embedlite-history-lookup-batch-size", KIND_OTHER, UNITS_COUNT,
+           mVisitedStore->LastBatchSize(),
+           "Number of URIs resolved by the last lookup batch.");
+
+    REPORT("embedlite-history-lookup-batch-latency", KIND_OTHER, UNITS_COUNT,
+           mVisitedStore->LastBatchLatencyUs(),
+           "Microseconds from the oldest request of the last lookup batch being "
+           "queued to its results reaching the main thread.");
+
+    REPORT("embedlite-history-lookup-batch-latency-max", KIND_OTHER, UNITS_COUNT,
+           mVisitedStore->MaxBatchLatencyUs(),
+           "Highest lookup batch latency seen so far, in microseconds.");
   }
 
   return NS_OK;
 }
 
+#undef REPORT
+
 NS_IMETHODIMP
 EmbedHistoryListener::Run()
 {
-  while (!mPendingURIs.IsEmpty()) {
-    nsCString uriString = mPendingURIs.Pop();
-    nsTArray<Link*>* list = sHistory->mListeners.Get(uriString);
-    if (list) {
-      for (unsigned int i = 0; i < list->Length(); i++) {
-        list->ElementAt(i)->SetLinkState(eLinkState_Visited);
+  // Notifications arriving while links are updated go to the next run
+  mRunScheduled = false;
+  nsTArray<nsCString> pending;
+  pending.SwapElements(mPendingURIs);
+  mPendingURISet.Clear();
+
+  MarkLinksVisited(pending);
+  return NS_OK;
+}
+
+void
+EmbedHistoryListener::MarkLinksVisited(const nsTArray<nsCString>& aSpecs)
+{
+  for (uint32_t i = 0; i < aSpecs.Length(); i++) {
+    const nsCString& uriString = aSpecs[i];
+    uint64_t hash = EmbedVisitedFilter::HashSpec(uriString);
+    EmbedLinkEntry* entry = mListeners.GetEntry(hash);
+    if (!entry)
+      continue;
+
+    // Entries are keyed by hash only, leave links of a colliding URI in place
+    nsAutoTArray<Link*, 1> visited;
+    for (uint32_t j = 0; j < entry->Length(); j++) {
+      Link* link = entry->ElementAt(j);
+      nsCOMPtr<nsIURI> linkURI = link->GetURI();
+      nsAutoCString linkSpec;
+      if (linkURI && NS_SUCCEEDED(linkURI->GetSpec(linkSpec)) && linkSpec.Equals(uriString)) {
+        visited.AppendElement(link);
+      }
+    }
+    // as per the IHistory interface contract, remove the
+    // Link pointers once they have been notified
+    for (uint32_t j = 0; j < visited.Length(); j++) {
+      entry->RemoveElement(visited[j]);
+      uint64_t ignored;
+      ForgetLink(visited[j], &ignored);
+    }
+    TimeStamp registered = entry->RegisteredAt();
+    if (entry->IsEmpty()) {
+      mListeners.RemoveEntry(hash);
+    }
+    for (uint32_t j = 0; j < visited.Length(); j++) {
+      visited[j]->SetLinkState(eLinkState_Visited);
+    }
+    if (sCollectStats && !registered.IsNull()) {
+      TimeStamp now = TimeStamp::Now();
+      for (uint32_t j = 0; j < visited.Length(); j++) {
+        mStats.LinkNotified(registered, now);
       }
-      // as per the IHistory interface contract, remove the
-      // Link pointers once they have been notified
-      sHistory->mListeners.Remove(uriString);
-      delete list;
     }
   }
-
-  return NS_OK;
 }
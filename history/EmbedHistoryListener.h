@@ -8,12 +8,25 @@
 #define EmbedHistoryListener_H_
 
 #include "mozilla/IHistory.h"
+#include "nsTHashtable.h"
 #include "nsDataHashtable.h"
-#include "nsTPriorityQueue.h"
+#include "nsClassHashtable.h"
+#include "nsHashKeys.h"
 #include "nsThreadUtils.h"
 #include "nsIEmbedAppService.h"
 #include "nsServiceManagerUtils.h"
 #include "nsIObserver.h"
+#include "nsITimer.h"
+#include "nsIMemoryReporter.h"
+#include "EmbedVisitedFilter.h"
+#include "EmbedLinkEntry.h"
+#include "EmbedVisitedStore.h"
+#include "EmbedHistoryStats.h"
+#include "prtime.h"
+#include "mozilla/gfx/Rect.h"
+
+// Redirect sources remembered until their navigation settles
+#define REDIRECT_RING_SIZE 16
 
 #define NS_EMBEDLITEHISTORY_CID \
 { 0xec7cf1e2, \
@@ -21,15 +34,20 @@
   0x11e2, \
   { 0xa7, 0x9a, 0xfb, 0x19, 0xfe, 0x29, 0x97 }}
 
+class nsPIDOMWindow;
+
 class EmbedHistoryListener : public mozilla::IHistory
                            , public nsIRunnable
                            , public nsIObserver
+                           , public nsIMemoryReporter
+                           , public EmbedVisitedStoreListener
 {
 public:
   NS_DECL_ISUPPORTS
   NS_DECL_IHISTORY
   NS_DECL_NSIRUNNABLE
   NS_DECL_NSIOBSERVER
+  NS_DECL_NSIMEMORYREPORTER
 
   nsresult Init() { return NS_OK; }
 
@@ -41,15 +59,146 @@ public:
 
   EmbedHistoryListener();
 
+  // EmbedVisitedStoreListener
+  virtual void OnVisitedLookup(const nsTArray<nsCString>& aVisited,
+                               const nsTArray<nsCString>& aMissed);
+
 private:
-  virtual ~EmbedHistoryListener() {}
+  virtual ~EmbedHistoryListener();
   nsIEmbedAppService* GetService();
+  void EnsureVisitedFilter();
+  void AddToVisitedFilter(const nsACString& aSpec);
+  void VisitedFilterChanged(bool aWasDirty);
+  void SaveVisitedFilter();
+  static void SaveVisitedFilterCallback(nsITimer* aTimer, void* aClosure);
+  EmbedVisitedStore* GetVisitedStore();
+  void QueueVisitedCheck(const nsACString& aSpec);
+  void FlushVisitedChecks();
+  static void FlushVisitedChecksCallback(nsITimer* aTimer, void* aClosure);
+  void FlushTitles();
+  static void FlushTitlesCallback(nsITimer* aTimer, void* aClosure);
+  void SendTitle(const nsACString& aSpec, const nsAString& aTitle);
+  void NotifyHistoryMessage(const nsAString& aMessage);
+  void SendURIMessage(const char* aMsg, const nsACString& aSpec,
+                      const nsAString* aTitle = nullptr);
+  void QueueVisitedNotification(const nsACString& aSpec);
+  void MarkLinksVisited(const nsTArray<nsCString>& aSpecs);
+  void ResolveVisitedState(const nsACString& aSpec);
+  void SendStats();
+  nsIThread* GetSerializerThread();
+  uint64_t GetLinkWindowID(mozilla::dom::Link* aLink);
+  bool ForgetLink(mozilla::dom::Link* aLink, uint64_t* aHash);
+  void DropShard(uint64_t aWindowID);
+  bool CanDeferLink(mozilla::dom::Link* aLink);
+  void ScheduleDeferredPass(uint32_t aDelay);
+  void ResolveDeferredLinks();
+  static void ResolveDeferredLinksCallback(nsITimer* aTimer, void* aClosure);
+  void RememberRedirectSource(const nsACString& aSpec, const nsACString& aReferrer);
+  void CollectRedirectChain(const nsACString& aLastVisited,
+                            nsTArray<nsCString>& aChain, nsACString& aOrigin);
+  double UpdateFrecency(const nsACString& aSpec, uint32_t aWeight);
+  void PruneFrecency(PRTime aNow);
+  void SendVisit(const nsACString& aSpec, const char* aTransition,
+                 double aFrecency, const nsTArray<nsCString>& aRedirects);
+
+  struct RedirectSource
+  {
+    nsCString mSpec;
+    nsCString mReferrer;
+    PRTime mTime;
+  };
+
+  // Inner window and URI hash of a link as of its registration, the
+  // document may have moved on by the time the link unregisters
+  struct LinkRecord
+  {
+    uint64_t mWindowID;
+    uint64_t mHash;
+  };
+
+  // Every link registered from one inner window
+  typedef nsTHashtable<nsPtrHashKey<mozilla::dom::Link> > LinkShard;
+
+  static PLDHashOperator DropShardLink(nsPtrHashKey<mozilla::dom::Link>* aEntry,
+                                       void* aClosure);
+
+  // URI hash of a deferred link and its page rect, measured when its
+  // document's reflow count was mReflows
+  struct DeferredLink
+  {
+    uint64_t mHash;
+    bool mMeasured;
+    uint64_t mReflows;
+    mozilla::gfx::Rect mRect;
+  };
+
+  typedef nsDataHashtable<nsPtrHashKey<nsPIDOMWindow>, uint64_t> WindowReflows;
+
+  bool IsLinkOffscreen(mozilla::dom::Link* aLink, DeferredLink& aDeferred,
+                       WindowReflows& aReflows);
+  static PLDHashOperator CollectDeferredLink(mozilla::dom::Link* aLink,
+                                             DeferredLink aDeferred, void* aClosure);
+
+  struct FrecencyEntry
+  {
+    double mScore;
+    PRTime mLastVisit;
+  };
+
+  static double DecayFrecency(const FrecencyEntry& aEntry, PRTime aNow);
+  static PLDHashOperator PruneFrecencyEntry(const nsACString& aKey,
+                                            FrecencyEntry& aEntry,
+                                            void* aClosure);
 
   static EmbedHistoryListener* sHistory;
+  static bool sUsePropertyBag;
+  static uint32_t sFrecencyHalfLife;
+  static bool sLazyVisited;
+  static bool sCollectStats;
+  static bool sCheckVisitedBatch;
+  static uint32_t sTitleDelay;
 
-  nsDataHashtable<nsCStringHashKey, nsTArray<mozilla::dom::Link*> *> mListeners;
-  nsTPriorityQueue<nsCString> mPendingURIs;
+  nsTHashtable<EmbedLinkEntry> mListeners;
+  // Registered links by inner window ID, lets a destroyed window drop all
+  // of its links at once
+  nsClassHashtable<nsUint64HashKey, LinkShard> mShards;
+  // Lets unregistering skip the URI and find the link's shard
+  nsDataHashtable<nsPtrHashKey<mozilla::dom::Link>, LinkRecord> mLinkRecords;
+  // FIFO of visited URIs waiting for Run(), mPendingURISet keeps it unique
+  nsTArray<nsCString> mPendingURIs;
+  nsTHashtable<nsCStringHashKey> mPendingURISet;
+  bool mRunScheduled;
   nsCOMPtr<nsIEmbedAppService> mService;
+  EmbedVisitedFilter mVisitedFilter;
+  bool mVisitedFilterLoaded;
+  nsCOMPtr<nsITimer> mFilterSaveTimer;
+  bool mFilterSaveScheduled;
+  nsRefPtr<EmbedVisitedStore> mVisitedStore;
+  bool mVisitedStoreChecked;
+  // URIs registered since the last flush, sent as one checkvisitedbatch
+  nsTArray<nsCString> mPendingChecks;
+  nsCOMPtr<nsITimer> mCheckTimer;
+  bool mCheckFlushScheduled;
+  // Latest title per URI since the last flush, in order of first change
+  nsTArray<nsCString> mTitleURIs;
+  nsDataHashtable<nsCStringHashKey, nsString> mPendingTitles;
+  nsCOMPtr<nsITimer> mTitleTimer;
+  // Most recent redirect sources of top level navigations, oldest overwritten
+  RedirectSource mRedirects[REDIRECT_RING_SIZE];
+  uint32_t mRedirectHead;
+  // Decayed visit score per URI, updated on every top level visit
+  nsDataHashtable<nsCStringHashKey, FrecencyEntry> mFrecency;
+  // Last known CSS viewport of top level windows, by outer window ID
+  nsDataHashtable<nsUint64HashKey, mozilla::gfx::Rect> mViewports;
+  // Links of deferred entries, checked again as the viewport moves
+  nsDataHashtable<nsPtrHashKey<mozilla::dom::Link>, DeferredLink> mDeferredLinks;
+  nsCOMPtr<nsITimer> mDeferredTimer;
+  bool mDeferredPassScheduled;
+  uint32_t mDeferredPassDelay;
+  EmbedHistoryStats mStats;
+  // Helper thread for embedlite.history.json.offmainthread
+  nsCOMPtr<nsIThread> mSerializerThread;
+  bool mSerializerShutdown;
 };
 
 #define NS_EMBED_HISTORY_CONTRACTID "@mozilla.org/embed-history-component;1"
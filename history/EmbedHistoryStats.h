@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedHistoryStats_H_
+#define EmbedHistoryStats_H_
+
+#include "nsTArray.h"
+#include "mozilla/TimeStamp.h"
+#include "mozilla/MemoryReporting.h"
+#include "EmbedJSONWriter.h"
+
+// Latency samples kept for percentiles, older ones are overwritten
+#define HISTORY_STATS_SAMPLES 4096
+
+/**
+ * Throughput and latency counters of the history component, collected
+ * while the embedlite.history.stats.enabled pref is set.
+ *
+ * Latency is measured per link, from the first RegisterVisitedCallback()
+ * of its URI to the SetLinkState() call marking it visited.
+ */
+class EmbedHistoryStats
+{
+public:
+  EmbedHistoryStats()
+  {
+    Reset();
+  }
+
+  void Reset()
+  {
+    mRegistered = 0;
+    mNotified = 0;
+    mMaxLatencyUs = 0;
+    mNextSample = 0;
+    mSamples.Clear();
+    mStart = mozilla::TimeStamp();
+    mLastNotify = mozilla::TimeStamp();
+  }
+
+  void LinkRegistered(mozilla::TimeStamp aNow)
+  {
+    if (mStart.IsNull()) {
+      mStart = aNow;
+    }
+    mRegistered++;
+  }
+
+  void LinkNotified(mozilla::TimeStamp aRegistered, mozilla::TimeStamp aNow)
+  {
+    mNotified++;
+    mLastNotify = aNow;
+    uint32_t latency = uint32_t((aNow - aRegistered).ToMicroseconds());
+    if (latency > mMaxLatencyUs) {
+      mMaxLatencyUs = latency;
+    }
+    if (mSamples.Length() < HISTORY_STATS_SAMPLES) {
+      mSamples.AppendElement(latency);
+    } else {
+      mSamples[mNextSample] = latency;
+      mNextSample = (mNextSample + 1) % HISTORY_STATS_SAMPLES;
+    }
+  }
+
+  void WriteJSON(EmbedJSONWriter& aWriter) const
+  {
+    nsTArray<uint32_t> sorted(mSamples);
+    sorted.Sort();
+
+    double seconds = 0;
+    if (!mStart.IsNull() && !mLastNotify.IsNull()) {
+      seconds = (mLastNotify - mStart).ToSeconds();
+    }
+
+    aWriter.IntProperty("registered", mRegistered);
+    aWriter.IntProperty("notified", mNotified);
+    aWriter.DoubleProperty("opsPerSec", seconds > 0 ? mNotified / seconds : 0);
+    aWriter.BeginObject("latencyUs");
+    aWriter.IntProperty("samples", sorted.Length());
+    aWriter.IntProperty("p50", Percentile(sorted, 50));
+    aWriter.IntProperty("p99", Percentile(sorted, 99));
+    aWriter.IntProperty("max", mMaxLatencyUs);
+    aWriter.EndObject();
+  }
+
+  size_t SizeOfExcludingThis(mozilla::MallocSizeOf aMallocSizeOf) const
+  {
+    return mSamples.SizeOfExcludingThis(aMallocSizeOf);
+  }
+
+private:
+  static uint32_t Percentile(const nsTArray<uint32_t>& aSorted, uint32_t aPercent)
+  {
+    if (aSorted.IsEmpty()) {
+      return 0;
+    }
+    return aSorted[(aSorted.Length() - 1) * aPercent / 100];
+  }
+
+  uint64_t mRegistered;
+  uint64_t mNotified;
+  uint32_t mMaxLatencyUs;
+  uint32_t mNextSample;
+  nsTArray<uint32_t> mSamples;
+  mozilla::TimeStamp mStart;
+  mozilla::TimeStamp mLastNotify;
+};
+
+#endif /*EmbedHistoryStats_H_*/
@@ -0,0 +1,124 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedLinkEntry_H_
+#define EmbedLinkEntry_H_
+
+#include "nsTHashtable.h"
+#include "nsTArray.h"
+#include "nsDebug.h"
+#include "mozilla/MemoryReporting.h"
+#include "mozilla/TimeStamp.h"
+
+namespace mozilla {
+namespace dom {
+class Link;
+}
+}
+
+/**
+ * Hashtable entry holding the links registered for one URI.
+ *
+ * Entries are keyed by the 64-bit hash of the URI spec instead of the spec
+ * itself. Links are checked against the real spec when they are notified,
+ * see EmbedHistoryListener::Run(). Most URIs have a single link on a page,
+ * which is stored inline without allocating an array.
+ */
+class EmbedLinkEntry : public PLDHashEntryHdr
+{
+public:
+  typedef const uint64_t& KeyType;
+  typedef const uint64_t* KeyTypePointer;
+  typedef mozilla::dom::Link Link;
+
+  EmbedLinkEntry(KeyTypePointer aKey)
+    : mHash(*aKey)
+    , mFirst(nullptr)
+    , mDeferred(false)
+  {
+  }
+
+  EmbedLinkEntry(const EmbedLinkEntry& aOther)
+    : mHash(aOther.mHash)
+    , mFirst(aOther.mFirst)
+    , mDeferred(aOther.mDeferred)
+    , mRegistered(aOther.mRegistered)
+  {
+    NS_NOTREACHED("EmbedLinkEntry is memmoved, do not copy");
+  }
+
+  ~EmbedLinkEntry()
+  {
+  }
+
+  KeyType GetKey() const { return mHash; }
+  bool KeyEquals(KeyTypePointer aKey) const { return mHash == *aKey; }
+
+  static KeyTypePointer KeyToPointer(KeyType aKey) { return &aKey; }
+  static PLDHashNumber HashKey(KeyTypePointer aKey)
+  {
+    return PLDHashNumber(*aKey ^ (*aKey >> 32));
+  }
+
+  enum { ALLOW_MEMMOVE = true };
+
+  bool IsEmpty() const { return !mFirst; }
+  uint32_t Length() const { return mFirst ? mOthers.Length() + 1 : 0; }
+  Link* ElementAt(uint32_t aIndex) const
+  {
+    return aIndex ? mOthers[aIndex - 1] : mFirst;
+  }
+
+  bool Contains(Link* aLink) const
+  {
+    return mFirst == aLink || (mFirst && mOthers.Contains(aLink));
+  }
+
+  // Visited state not asked for yet, links are off screen
+  bool IsDeferred() const { return mDeferred; }
+  void SetDeferred(bool aDeferred) { mDeferred = aDeferred; }
+
+  // Set while history stats are collected
+  mozilla::TimeStamp RegisteredAt() const { return mRegistered; }
+  void SetRegisteredAt(mozilla::TimeStamp aTime) { mRegistered = aTime; }
+
+  void AppendElement(Link* aLink)
+  {
+    if (!mFirst) {
+      mFirst = aLink;
+    } else {
+      mOthers.AppendElement(aLink);
+    }
+  }
+
+  // Order of links is not preserved
+  bool RemoveElement(Link* aLink)
+  {
+    if (mFirst != aLink) {
+      return mOthers.RemoveElement(aLink);
+    }
+    if (mOthers.IsEmpty()) {
+      mFirst = nullptr;
+    } else {
+      mFirst = mOthers.LastElement();
+      mOthers.RemoveElementAt(mOthers.Length() - 1);
+    }
+    return true;
+  }
+
+  size_t SizeOfExcludingThis(mozilla::MallocSizeOf aMallocSizeOf) const
+  {
+    return mOthers.SizeOfExcludingThis(aMallocSizeOf);
+  }
+
+private:
+  uint64_t mHash;
+  Link* mFirst;
+  nsTArray<Link*> mOthers;
+  bool mDeferred;
+  mozilla::TimeStamp mRegistered;
+};
+
+#endif /*EmbedLinkEntry_H_*/
@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "EmbedVisitedFilter.h"
+#include "nsIFile.h"
+#include "prio.h"
+
+// 2^20 bits (128KB) with 7 probes keeps the false positive rate around 1%
+// for 100k distinct URIs.
+static const uint32_t kFilterBits = 1 << 20;
+static const uint32_t kFilterWords = kFilterBits / 32;
+static const uint32_t kFilterProbes = 7;
+
+static const uint32_t kFilterMagic = 0x46425645; // "EVBF"
+static const uint32_t kFilterVersion = 2;
+
+// Header flags
+static const uint32_t kFilterSeeded = 1 << 0;
+
+struct FilterFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t words;
+  uint32_t count;
+  uint32_t flags;
+};
+
+EmbedVisitedFilter::EmbedVisitedFilter()
+  : mCount(0)
+  , mSeeded(false)
+  , mDirty(false)
+{
+  mBits.SetLength(kFilterWords);
+  memset(mBits.Elements(), 0, kFilterWords * sizeof(uint32_t));
+}
+
+/*static*/
+uint64_t
+EmbedVisitedFilter::HashSpec(const nsACString& aSpec)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  const char* data = aSpec.BeginReading();
+  for (uint32_t i = 0; i < aSpec.Length(); i++) {
+    hash ^= uint8_t(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void
+EmbedVisitedFilter::Add(const nsACString& aSpec)
+{
+  uint64_t hash = HashSpec(aSpec);
+  uint32_t h1 = uint32_t(hash);
+  uint32_t h2 = uint32_t(hash >> 32) | 1;
+  bool added = false;
+  for (uint32_t i = 0; i < kFilterProbes; i++) {
+    uint32_t bit = (h1 + i * h2) & (kFilterBits - 1);
+    uint32_t mask = 1u << (bit & 31);
+    if (!(mBits[bit >> 5] & mask)) {
+      mBits[bit >> 5] |= mask;
+      added = true;
+    }
+  }
+  if (added) {
+    mCount++;
+    mDirty = true;
+  }
+}
+
+bool
+EmbedVisitedFilter::MightContain(const nsACString& aSpec) const
+{
+  uint64_t hash = HashSpec(aSpec);
+  uint32_t h1 = uint32_t(hash);
+  uint32_t h2 = uint32_t(hash >> 32) | 1;
+  for (uint32_t i = 0; i < kFilterProbes; i++) {
+    uint32_t bit = (h1 + i * h2) & (kFilterBits - 1);
+    if (!(mBits[bit >> 5] & (1u << (bit & 31)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+EmbedVisitedFilter::SetSeeded(bool aSeeded)
+{
+  if (mSeeded != aSeeded) {
+    mSeeded = aSeeded;
+    mDirty = true;
+  }
+}
+
+void
+EmbedVisitedFilter::Clear()
+{
+  memset(mBits.Elements(), 0, kFilterWords * sizeof(uint32_t));
+  mCount = 0;
+  mDirty = true;
+}
+
+nsresult
+EmbedVisitedFilter::Load(nsIFile* aFile)
+{
+  NS_ENSURE_ARG(aFile);
+
+  PRFileDesc* fd = nullptr;
+  nsresult rv = aFile->OpenNSPRFileDesc(PR_RDONLY, 0, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  FilterFileHeader header;
+  int32_t headerSize = sizeof(FilterFileHeader);
+  int32_t bitsSize = kFilterWords * sizeof(uint32_t);
+  if (PR_Read(fd, &header, headerSize) != headerSize ||
+      header.magic != kFilterMagic ||
+      header.version != kFilterVersion ||
+      header.words != kFilterWords ||
+      PR_Read(fd, mBits.Elements(), bitsSize) != bitsSize) {
+    PR_Close(fd);
+    Clear();
+    return NS_ERROR_FILE_CORRUPTED;
+  }
+  PR_Close(fd);
+
+  mCount = header.count;
+  mSeeded = !!(header.flags & kFilterSeeded);
+  mDirty = false;
+  return NS_OK;
+}
+
+nsresult
+EmbedVisitedFilter::Save(nsIFile* aFile)
+{
+  NS_ENSURE_ARG(aFile);
+
+  PRFileDesc* fd = nullptr;
+  nsresult rv = aFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE, 0600, &fd);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  FilterFileHeader header = { kFilterMagic, kFilterVersion, kFilterWords, mCount,
+                              mSeeded ? kFilterSeeded : 0 };
+  int32_t headerSize = sizeof(FilterFileHeader);
+  int32_t bitsSize = kFilterWords * sizeof(uint32_t);
+  if (PR_Write(fd, &header, headerSize) != headerSize ||
+      PR_Write(fd, mBits.Elements(), bitsSize) != bitsSize) {
+    PR_Close(fd);
+    return NS_ERROR_FAILURE;
+  }
+  PR_Close(fd);
+
+  mDirty = false;
+  return NS_OK;
+}
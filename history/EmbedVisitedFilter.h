@@ -0,0 +1,59 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedVisitedFilter_H_
+#define EmbedVisitedFilter_H_
+
+#include "nsTArray.h"
+#include "nsStringGlue.h"
+#include "mozilla/MemoryReporting.h"
+
+class nsIFile;
+
+/**
+ * Bloom filter of visited URI specs.
+ *
+ * A negative answer from MightContain() means the URI was never recorded
+ * as visited, so the "checkvisited" round trip to the embedder can be
+ * skipped. Positive answers may be false positives and still have to be
+ * confirmed by the embedder.
+ */
+class EmbedVisitedFilter
+{
+public:
+  EmbedVisitedFilter();
+
+  void Add(const nsACString& aSpec);
+  bool MightContain(const nsACString& aSpec) const;
+  void Clear();
+
+  /**
+   * The filter only knows about visits it has seen itself, so negative
+   * lookups are trusted only once the embedder has added its whole
+   * history. The flag is saved with the filter.
+   */
+  bool IsSeeded() const { return mSeeded; }
+  void SetSeeded(bool aSeeded);
+  bool IsDirty() const { return mDirty; }
+  uint32_t Count() const { return mCount; }
+
+  size_t SizeOfExcludingThis(mozilla::MallocSizeOf aMallocSizeOf) const
+  {
+    return mBits.SizeOfExcludingThis(aMallocSizeOf);
+  }
+
+  nsresult Load(nsIFile* aFile);
+  nsresult Save(nsIFile* aFile);
+
+  static uint64_t HashSpec(const nsACString& aSpec);
+
+private:
+  nsTArray<uint32_t> mBits;
+  uint32_t mCount;
+  bool mSeeded;
+  bool mDirty;
+};
+
+#endif /*EmbedVisitedFilter_H_*/
@@ -0,0 +1,329 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "EmbedVisitedStore.h"
+
+#include "nsIFile.h"
+#include "nsServiceManagerUtils.h"
+#include "nsDirectoryServiceUtils.h"
+#include "nsAppDirectoryServiceDefs.h"
+#include "mozIStorageService.h"
+#include "mozStorageCID.h"
+#include "mozStorageHelper.h"
+#include "nsThreadUtils.h"
+#include "prtime.h"
+
+using namespace mozilla;
+
+#define VISITED_STORE_FILE "embedhistory.sqlite"
+
+class LookupResultRunnable : public nsRunnable
+{
+public:
+  LookupResultRunnable(EmbedVisitedStore* aStore)
+    : mStore(aStore)
+  {
+  }
+
+  NS_IMETHOD Run()
+  {
+    mStore->NotifyLookup(mVisited, mMissed, mQueued);
+    return NS_OK;
+  }
+
+  nsRefPtr<EmbedVisitedStore> mStore;
+  nsTArray<nsCString> mVisited;
+  nsTArray<nsCString> mMissed;
+  TimeStamp mQueued;
+};
+
+class StoreWriteRunnable : public nsRunnable
+{
+public:
+  StoreWriteRunnable(EmbedVisitedStore* aStore, EmbedVisitedStore::WriteType aType,
+                     const nsACString& aSpec, const nsAString& aTitle)
+    : mStore(aStore)
+    , mType(aType)
+    , mSpec(aSpec)
+    , mTitle(aTitle)
+  {
+  }
+
+  NS_IMETHOD Run()
+  {
+    mStore->ExecuteWrite(mType, mSpec, mTitle);
+    return NS_OK;
+  }
+
+private:
+  nsRefPtr<EmbedVisitedStore> mStore;
+  EmbedVisitedStore::WriteType mType;
+  nsCString mSpec;
+  nsString mTitle;
+};
+
+EmbedVisitedStore::EmbedVisitedStore(EmbedVisitedStoreListener* aListener)
+  : mListener(aListener)
+  , mStatements(mConnection)
+  , mLookupLock("EmbedVisitedStore.mLookupLock")
+  , mLastBatchSize(0)
+  , mLastBatchLatencyUs(0)
+  , mMaxBatchLatencyUs(0)
+{
+}
+
+EmbedVisitedStore::~EmbedVisitedStore()
+{
+}
+
+nsresult
+EmbedVisitedStore::Init()
+{
+  nsresult rv = NS_GetSpecialDirectory(NS_APP_USER_PROFILE_50_DIR, getter_AddRefs(mFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mFile->AppendNative(NS_LITERAL_CSTRING(VISITED_STORE_FILE));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mStorage = do_GetService(MOZ_STORAGE_SERVICE_CONTRACTID, &rv);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Opening and setting up the database is left to the store thread, work
+  // queued meanwhile runs once it is done
+  rv = NS_NewNamedThread("HistoryLookup", getter_AddRefs(mLookupThread));
+  NS_ENSURE_SUCCESS(rv, rv);
+  return mLookupThread->Dispatch(NS_NewRunnableMethod(this, &EmbedVisitedStore::OpenConnection),
+                                 NS_DISPATCH_NORMAL);
+}
+
+void
+EmbedVisitedStore::OpenConnection()
+{
+  nsCOMPtr<mozIStorageConnection> connection;
+  nsresult rv = mStorage->OpenDatabase(mFile, getter_AddRefs(connection));
+  NS_ENSURE_SUCCESS(rv, );
+
+  // WAL keeps visit writes cheap and lookups from waiting on them
+  rv = connection->ExecuteSimpleSQL(NS_LITERAL_CSTRING("PRAGMA journal_mode = WAL"));
+  if (NS_SUCCEEDED(rv)) {
+    rv = connection->ExecuteSimpleSQL(NS_LITERAL_CSTRING("PRAGMA synchronous = NORMAL"));
+  }
+  if (NS_SUCCEEDED(rv)) {
+    rv = connection->ExecuteSimpleSQL(NS_LITERAL_CSTRING(
+      "CREATE TABLE IF NOT EXISTS moz_embed_visits ("
+        "url TEXT PRIMARY KEY, "
+        "title TEXT, "
+        "visit_count INTEGER NOT NULL DEFAULT 0, "
+        "last_visit_date INTEGER)"));
+  }
+  if (NS_FAILED(rv)) {
+    connection->Close();
+    return;
+  }
+  mConnection = connection;
+}
+
+void
+EmbedVisitedStore::CloseConnection()
+{
+  mStatements.FinalizeStatements();
+  if (mConnection) {
+    mConnection->Close();
+    mConnection = nullptr;
+  }
+}
+
+void
+EmbedVisitedStore::Shutdown()
+{
+  mListener = nullptr;
+  if (mLookupThread) {
+    mLookupThread->Dispatch(NS_NewRunnableMethod(this, &EmbedVisitedStore::CloseConnection),
+                            NS_DISPATCH_NORMAL);
+    mLookupThread->Shutdown();
+    mLookupThread = nullptr;
+  }
+}
+
+void
+EmbedVisitedStore::DispatchWrite(WriteType aType, const nsACString& aSpec,
+                                 const nsAString& aTitle)
+{
+  if (!mLookupThread)
+    return;
+
+  nsRefPtr<StoreWriteRunnable> write = new StoreWriteRunnable(this, aType, aSpec, aTitle);
+  mLookupThread->Dispatch(write, NS_DISPATCH_NORMAL);
+}
+
+void
+EmbedVisitedStore::RecordVisit(const nsACString& aSpec)
+{
+  DispatchWrite(eWriteVisit, aSpec);
+}
+
+void
+EmbedVisitedStore::SetTitle(const nsACString& aSpec, const nsAString& aTitle)
+{
+  DispatchWrite(eWriteTitle, aSpec, aTitle);
+}
+
+void
+EmbedVisitedStore::RemoveVisit(const nsACString& aSpec)
+{
+  DispatchWrite(eWriteRemove, aSpec);
+}
+
+void
+EmbedVisitedStore::Clear()
+{
+  DispatchWrite(eWriteClear, EmptyCString());
+}
+
+void
+EmbedVisitedStore::ExecuteWrite(WriteType aType, const nsACString& aSpec,
+                                const nsAString& aTitle)
+{
+  if (!mConnection)
+    return;
+
+  switch (aType) {
+  case eWriteVisit: {
+    nsCOMPtr<mozIStorageStatement> insert = mStatements.GetCachedStatement(
+      "INSERT OR IGNORE INTO moz_embed_visits (url) VALUES (:url)");
+    nsCOMPtr<mozIStorageStatement> update = mStatements.GetCachedStatement(
+      "UPDATE moz_embed_visits "
+      "SET visit_count = visit_count + 1, last_visit_date = :date "
+      "WHERE url = :url");
+    NS_ENSURE_TRUE(insert && update, );
+
+    mozStorageTransaction transaction(mConnection, false);
+    {
+      mozStorageStatementScoper scoper(insert);
+      insert->BindUTF8StringByName(NS_LITERAL_CSTRING("url"), aSpec);
+      insert->Execute();
+    }
+    {
+      mozStorageStatementScoper scoper(update);
+      update->BindUTF8StringByName(NS_LITERAL_CSTRING("url"), aSpec);
+      update->BindInt64ByName(NS_LITERAL_CSTRING("date"), PR_Now());
+      update->Execute();
+    }
+    transaction.Commit();
+    break;
+  }
+  case eWriteTitle: {
+    nsCOMPtr<mozIStorageStatement> stmt = mStatements.GetCachedStatement(
+      "UPDATE moz_embed_visits SET title = :title WHERE url = :url");
+    NS_ENSURE_TRUE(stmt, );
+    mozStorageStatementScoper scoper(stmt);
+    stmt->BindUTF8StringByName(NS_LITERAL_CSTRING("url"), aSpec);
+    stmt->BindStringByName(NS_LITERAL_CSTRING("title"), aTitle);
+    stmt->Execute();
+    break;
+  }
+  case eWriteRemove: {
+    nsCOMPtr<mozIStorageStatement> stmt = mStatements.GetCachedStatement(
+      "DELETE FROM moz_embed_visits WHERE url = :url");
+    NS_ENSURE_TRUE(stmt, );
+    mozStorageStatementScoper scoper(stmt);
+    stmt->BindUTF8StringByName(NS_LITERAL_CSTRING("url"), aSpec);
+    stmt->Execute();
+    break;
+  }
+  case eWriteClear:
+    mConnection->ExecuteSimpleSQL(NS_LITERAL_CSTRING("DELETE FROM moz_embed_visits"));
+    break;
+  }
+}
+
+void
+EmbedVisitedStore::LookupVisited(const nsACString& aSpec)
+{
+  if (!mLookupThread) {
+    nsTArray<nsCString> visited;
+    nsTArray<nsCString> missed;
+    missed.AppendElement(aSpec);
+    NotifyLookup(visited, missed, TimeStamp::Now());
+    return;
+  }
+
+  bool wasIdle;
+  {
+    MutexAutoLock lock(mLookupLock);
+    wasIdle = mLookupQueue.IsEmpty();
+    LookupRequest* request = mLookupQueue.AppendElement();
+    request->mSpec = aSpec;
+    request->mQueued = TimeStamp::Now();
+  }
+  // Only the request that finds the queue idle wakes the lookup thread,
+  // later ones ride along with the same batch
+  if (wasIdle) {
+    mLookupThread->Dispatch(NS_NewRunnableMethod(this, &EmbedVisitedStore::ResolveLookups),
+                            NS_DISPATCH_NORMAL);
+  }
+}
+
+uint32_t
+EmbedVisitedStore::LookupQueueDepth()
+{
+  MutexAutoLock lock(mLookupLock);
+  return mLookupQueue.Length();
+}
+
+void
+EmbedVisitedStore::ResolveLookups()
+{
+  nsCOMPtr<mozIStorageStatement> lookup;
+  if (mConnection) {
+    lookup = mStatements.GetCachedStatement(
+      "SELECT 1 FROM moz_embed_visits WHERE url = :url AND visit_count > 0");
+  }
+
+  nsTArray<LookupRequest> requests;
+  {
+    MutexAutoLock lock(mLookupLock);
+    requests.SwapElements(mLookupQueue);
+  }
+
+  nsRefPtr<LookupResultRunnable> result = new LookupResultRunnable(this);
+  for (uint32_t i = 0; i < requests.Length(); i++) {
+    const LookupRequest& request = requests[i];
+    if (result->mQueued.IsNull() || request.mQueued < result->mQueued) {
+      result->mQueued = request.mQueued;
+    }
+
+    bool visited = false;
+    if (lookup) {
+      mozStorageStatementScoper scoper(lookup);
+      if (NS_SUCCEEDED(lookup->BindUTF8StringByName(NS_LITERAL_CSTRING("url"),
+                                                    request.mSpec))) {
+        bool hasRow = false;
+        visited = NS_SUCCEEDED(lookup->ExecuteStep(&hasRow)) && hasRow;
+      }
+    }
+    if (visited) {
+      result->mVisited.AppendElement(request.mSpec);
+    } else {
+      result->mMissed.AppendElement(request.mSpec);
+    }
+  }
+
+  NS_DispatchToMainThread(result);
+}
+
+void
+EmbedVisitedStore::NotifyLookup(const nsTArray<nsCString>& aVisited,
+                                const nsTArray<nsCString>& aMissed,
+                                TimeStamp aQueued)
+{
+  mLastBatchSize = aVisited.Length() + aMissed.Length();
+  mLastBatchLatencyUs = uint32_t((TimeStamp::Now() - aQueued).ToMicroseconds());
+  if (mLastBatchLatencyUs > mMaxBatchLatencyUs) {
+    mMaxBatchLatencyUs = mLastBatchLatencyUs;
+  }
+
+  if (mListener) {
+    mListener->OnVisitedLookup(aVisited, aMissed);
+  }
+}
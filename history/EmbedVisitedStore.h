@@ -0,0 +1,114 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef EmbedVisitedStore_H_
+#define EmbedVisitedStore_H_
+
+#include "nsCOMPtr.h"
+#include "nsISupportsImpl.h"
+#include "nsStringGlue.h"
+#include "mozIStorageConnection.h"
+#include "mozIStorageService.h"
+#include "mozIStorageStatement.h"
+#include "nsIFile.h"
+#include "mozilla/storage/StatementCache.h"
+#include "mozilla/Mutex.h"
+#include "mozilla/TimeStamp.h"
+#include "nsIThread.h"
+#include "nsTArray.h"
+
+class EmbedVisitedStoreListener
+{
+public:
+  virtual void OnVisitedLookup(const nsTArray<nsCString>& aVisited,
+                               const nsTArray<nsCString>& aMissed) = 0;
+};
+
+/**
+ * Optional in-engine store of visited URIs, enabled with the
+ * embedlite.history.localstore.enabled pref.
+ *
+ * The database is opened, written and read only on a dedicated store
+ * thread, the main thread just queues work for it. Lookups resolve
+ * everything queued so far in one batch and report it back to the main
+ * thread with a single EmbedVisitedStoreListener call.
+ *
+ * Visits are kept until the embedder removes them from its history, see
+ * RemoveVisit(), or clears it.
+ */
+class EmbedVisitedStore MOZ_FINAL
+{
+public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(EmbedVisitedStore)
+
+  EmbedVisitedStore(EmbedVisitedStoreListener* aListener);
+
+  nsresult Init();
+  void Shutdown();
+
+  void RecordVisit(const nsACString& aSpec);
+  void SetTitle(const nsACString& aSpec, const nsAString& aTitle);
+  void RemoveVisit(const nsACString& aSpec);
+  void LookupVisited(const nsACString& aSpec);
+  void Clear();
+
+  enum WriteType
+  {
+    eWriteVisit,
+    eWriteTitle,
+    eWriteRemove,
+    eWriteClear
+  };
+
+  // URIs queued and not yet taken by the store thread
+  uint32_t LookupQueueDepth();
+  uint32_t LastBatchSize() const { return mLastBatchSize; }
+  // Time from the oldest request of the batch being queued to its results
+  // reaching the main thread
+  uint32_t LastBatchLatencyUs() const { return mLastBatchLatencyUs; }
+  uint32_t MaxBatchLatencyUs() const { return mMaxBatchLatencyUs; }
+
+  // Store thread
+  void OpenConnection();
+  void CloseConnection();
+  void ExecuteWrite(WriteType aType, const nsACString& aSpec, const nsAString& aTitle);
+  void ResolveLookups();
+
+  // Main thread, results of one ResolveLookups() pass
+  void NotifyLookup(const nsTArray<nsCString>& aVisited,
+                    const nsTArray<nsCString>& aMissed,
+                    mozilla::TimeStamp aQueued);
+
+private:
+  ~EmbedVisitedStore();
+
+  struct LookupRequest
+  {
+    nsCString mSpec;
+    mozilla::TimeStamp mQueued;
+  };
+
+  void DispatchWrite(WriteType aType, const nsACString& aSpec,
+                     const nsAString& aTitle = EmptyString());
+
+  EmbedVisitedStoreListener* mListener;
+  // Set on the main thread before the store thread starts
+  nsCOMPtr<mozIStorageService> mStorage;
+  nsCOMPtr<nsIFile> mFile;
+
+  nsCOMPtr<nsIThread> mLookupThread;
+  // Owned by the store thread, null if the database could not be opened
+  nsCOMPtr<mozIStorageConnection> mConnection;
+  mozilla::storage::StatementCache<mozIStorageStatement> mStatements;
+  // Filled on the main thread, swapped out whole by ResolveLookups()
+  mozilla::Mutex mLookupLock;
+  nsTArray<LookupRequest> mLookupQueue;
+
+  uint32_t mLastBatchSize;
+  uint32_t mLastBatchLatencyUs;
+  uint32_t mMaxBatchLatencyUs;
+};
+
+#endif /*EmbedVisitedStore_H_*/
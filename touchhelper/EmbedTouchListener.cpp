@@ -42,17 +42,64 @@
 #include "nsIDOMHTMLAnchorElement.h"
 #include "nsIDOMHTMLAreaElement.h"
 #include "nsIDOMHTMLImageElement.h"
+#include "mozilla/Preferences.h"
+#include "nsThreadUtils.h"
+#include "nsIContent.h"
+#include "nsIFrame.h"
+#include "nsPresContext.h"
+#include "nsStyleStruct.h"
+#include "nsStyleConsts.h"
+#include "mozilla/dom/Element.h"
+#include <math.h>
 
 using namespace mozilla;
 
+// History defers visited checks of off screen links with this pref,
+// it needs to know where the viewport is
+#define LAZY_VISITED_PREF "embedlite.history.lazyvisited.enabled"
+
+static bool sNotifyViewport = false;
+
+// Answer double taps at once from recent targets, the DOM walk follows
+// in a separate runnable and only corrects the zoom when needed
+#define PROVISIONAL_ZOOM_PREF "embedlite.touch.doubletap.provisional"
+
+static bool sProvisionalZoom = true;
+
+// Recent double tap targets kept for provisional zooms
+#define ZOOM_RECTS_SIZE 32
+
+// Provisional zooms within this many CSS pixels per edge are not corrected,
+// recent targets this close are kept once
+#define ZOOM_CORRECTION_TOLERANCE 8
+
+static bool
+IsNearlyEqualRect(const gfx::Rect& aA, const gfx::Rect& aB)
+{
+    return fabs(aA.x - aB.x) <= ZOOM_CORRECTION_TOLERANCE &&
+           fabs(aA.y - aB.y) <= ZOOM_CORRECTION_TOLERANCE &&
+           fabs(aA.XMost() - aB.XMost()) <= ZOOM_CORRECTION_TOLERANCE &&
+           fabs(aA.YMost() - aB.YMost()) <= ZOOM_CORRECTION_TOLERANCE;
+}
+
 EmbedTouchListener::EmbedTouchListener(nsIDOMWindow* aWin)
   : DOMWindow(aWin)
   , mGotViewPortUpdate(false)
+  , mZoomRectsReflows(0)
+  , mTapPending(false)
+  , mHasProvisionalZoom(false)
 {
     if (!mService) {
         mService = do_GetService("@mozilla.org/embedlite-app-service;1");
     }
     mService->GetIDByWindow(aWin, &mTopWinid);
+
+    static bool sPrefCached = false;
+    if (!sPrefCached) {
+        sPrefCached = true;
+        Preferences::AddBoolVarCache(&sNotifyViewport, LAZY_VISITED_PREF, false);
+        Preferences::AddBoolVarCache(&sProvisionalZoom, PROVISIONAL_ZOOM_PREF, true);
+    }
 }
 
 EmbedTouchListener::~EmbedTouchListener()
@@ -113,6 +160,17 @@ void EmbedTouchListener::RequestContentRepaint(const mozilla::layers::FrameMetri
     mCssPageRect = gfx::Rect(aMetrics.GetScrollableRect().x, aMetrics.GetScrollableRect().y,
                              aMetrics.GetScrollableRect().width, aMetrics.GetScrollableRect().height);
 
+    if (sNotifyViewport) {
+        nsCOMPtr<nsIObserverService> observerService =
+            do_GetService(NS_OBSERVERSERVICE_CONTRACTID);
+        if (observerService) {
+            nsString data;
+            data.AppendPrintf("%g,%g,%g,%g", mCssCompositedRect.x, mCssCompositedRect.y,
+                              mCssCompositedRect.width, mCssCompositedRect.height);
+            observerService->NotifyObservers(DOMWindow, "embedlite-viewport-changed", data.get());
+        }
+    }
+
 //    LOGT("EmbedTouchListener::RequestContentRepaint mCssPageRect %g %g %g %g", mCssPageRect.x, mCssPageRect.y, mCssPageRect.width, mCssPageRect.height);
 //    LOGT("EmbedTouchListener::RequestContentRepaint Viewport %g %g %g %g", mViewport.x, mViewport.y, mViewport.width, mViewport.height);
 //    LOGT("EmbedTouchListener::RequestContentRepaint mCssCompositedRect %g %g %g %g", mCssCompositedRect.x, mCssCompositedRect.y, mCssCompositedRect.width, mCssCompositedRect.height);
@@ -126,52 +184,165 @@ void EmbedTouchListener::HandleDoubleTap(const CSSPoint& aPoint, int32_t, const
         return;
     }
 
+    if (!sProvisionalZoom) {
+        DoubleTapZoom(aPoint, mCssCompositedRect, false);
+        return;
+    }
+
+    mHasProvisionalZoom = GetProvisionalZoom(aPoint, mProvisionalZoom);
+    if (mHasProvisionalZoom) {
+        SendZoomRect(mProvisionalZoom);
+    }
+    mPendingTap = aPoint;
+    // The provisional zoom may update the viewport before the runnable
+    mPendingViewport = mCssCompositedRect;
+    if (!mTapPending) {
+        mTapPending = true;
+        NS_DispatchToCurrentThread(NS_NewRunnableMethod(this, &EmbedTouchListener::RefineDoubleTap));
+    }
+}
+
+void
+EmbedTouchListener::RefineDoubleTap()
+{
+    mTapPending = false;
+    DoubleTapZoom(mPendingTap, mPendingViewport, mHasProvisionalZoom);
+    mHasProvisionalZoom = false;
+}
+
+/* Find the zoom target of a double tap in the DOM. With aProvisional the
+ * zoom in mProvisionalZoom was already sent and is only replaced when the
+ * target turns out to be noticeably different.
+ */
+void
+EmbedTouchListener::DoubleTapZoom(const CSSPoint& aPoint, const gfx::Rect& aViewport, bool aProvisional)
+{
     nsCOMPtr<nsIDOMElement> element;
-    gfxRect retRect(0,0,0,0);
     AnyElementFromPoint(DOMWindow, aPoint.x, aPoint.y, getter_AddRefs(element));
-    if (!element) {
-        mService->ZoomToRect(mTopWinid, 0, 0, 0, 0);
+    // Empty target zooms out
+    gfx::Rect target(0, 0, 0, 0);
+    if (element) {
+        nsCOMPtr<nsIDOMNode> node = do_QueryInterface(element);
+        NS_ENSURE_TRUE(node, );
+        nsCOMPtr<nsIDOMElement> elementtest = element;
+        while (elementtest && !ShouldZoomToElement(elementtest)) {
+            node->GetParentNode(getter_AddRefs(node));
+            elementtest = do_QueryInterface(node);
+            if (elementtest) {
+                element = elementtest;
+            }
+        }
+
+        // Don't zoom in or out when in full screen
+        nsCOMPtr<nsIDOMDocument> document;
+        NS_ENSURE_SUCCESS(node->GetOwnerDocument(getter_AddRefs(document)), );
+        bool isFullScreen(false);
+        document->GetMozFullScreen(&isFullScreen);
+        if (isFullScreen) {
+            return;
+        }
+
+        if (element) {
+            gfx::Rect rect = GetBoundingContentRect(element);
+            RememberZoomRect(rect);
+            if (!GetZoomTarget(rect, aViewport, true, true, target)) {
+                return;
+            }
+        }
+    }
+
+    if (aProvisional && IsNearlyEqualRect(target, mProvisionalZoom)) {
         return;
     }
+    SendZoomRect(target);
+}
+
+/* Estimate the zoom of a double tap from the smallest recent target
+ * containing it, without touching the DOM beyond the reflow count.
+ */
+bool
+EmbedTouchListener::GetProvisionalZoom(const CSSPoint& aPoint, gfx::Rect& aTarget)
+{
+    if (mZoomRects.IsEmpty()) {
+        return false;
+    }
+    nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(DOMWindow);
+    uint64_t reflows;
+    if (!utils || NS_FAILED(utils->GetFramesReflowed(&reflows)) || reflows != mZoomRectsReflows) {
+        mZoomRects.Clear();
+        return false;
+    }
 
-    nsCOMPtr<nsIDOMNode> node = do_QueryInterface(element);
-    NS_ENSURE_TRUE(node, );
-    nsCOMPtr<nsIDOMElement> elementtest = element;
-    while (elementtest && !ShouldZoomToElement(elementtest)) {
-        node->GetParentNode(getter_AddRefs(node));
-        elementtest = do_QueryInterface(node);
-        if (elementtest) {
-            element = elementtest;
+    gfx::Point point(aPoint.x + mCssCompositedRect.x, aPoint.y + mCssCompositedRect.y);
+    const gfx::Rect* best = nullptr;
+    for (uint32_t i = 0; i < mZoomRects.Length(); ++i) {
+        const gfx::Rect& rect = mZoomRects[i];
+        if (rect.Contains(point) &&
+            (!best || rect.width * rect.height < best->width * best->height)) {
+            best = &rect;
         }
     }
+    return best && GetZoomTarget(*best, mCssCompositedRect, true, true, aTarget);
+}
 
-    // Don't zoom in or out when in full screen
-    nsCOMPtr<nsIDOMDocument> document;
-    NS_ENSURE_SUCCESS(node->GetOwnerDocument(getter_AddRefs(document)), );
-    bool isFullScreen(false);
-    document->GetMozFullScreen(&isFullScreen);
-    if (isFullScreen) {
+void
+EmbedTouchListener::RememberZoomRect(const gfx::Rect& aRect)
+{
+    if (aRect.IsEmpty()) {
+        return;
+    }
+    nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(DOMWindow);
+    uint64_t reflows;
+    if (!utils || NS_FAILED(utils->GetFramesReflowed(&reflows))) {
         return;
     }
+    if (reflows != mZoomRectsReflows || mZoomRects.Length() >= ZOOM_RECTS_SIZE) {
+        mZoomRects.Clear();
+        mZoomRectsReflows = reflows;
+    }
+    // Replace a close match so the list keeps the latest measurement
+    for (uint32_t i = 0; i < mZoomRects.Length(); ++i) {
+        if (IsNearlyEqualRect(mZoomRects[i], aRect)) {
+            mZoomRects[i] = aRect;
+            return;
+        }
+    }
+    mZoomRects.AppendElement(aRect);
+}
 
-    if (!element) {
-        mService->ZoomToRect(mTopWinid, 0, 0, 0, 0);
-    } else {
-        ZoomToElement(element, aPoint.y, true, true);
+static bool
+GetFrameWindow(nsIDOMElement* aElement, nsIDOMWindow** aWindow)
+{
+    nsCOMPtr<nsIDOMHTMLIFrameElement> elAsIFrame = do_QueryInterface(aElement);
+    nsCOMPtr<nsIDOMHTMLFrameElement> elAsFrame = do_QueryInterface(aElement);
+    nsCOMPtr<nsIDOMDocument> contentDocument;
+    if (!elAsIFrame || NS_FAILED(elAsIFrame->GetContentDocument(getter_AddRefs(contentDocument)))) {
+        if (!elAsFrame || NS_FAILED(elAsFrame->GetContentDocument(getter_AddRefs(contentDocument)))) {
+            return false;
+        }
     }
+    return contentDocument &&
+           NS_SUCCEEDED(contentDocument->GetDefaultView(aWindow)) && *aWindow;
 }
 
 void
 EmbedTouchListener::AnyElementFromPoint(nsIDOMWindow* aWindow, double aX, double aY, nsIDOMElement* *aElem)
 {
     mService->EnterSecureJSContext();
-    nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(aWindow);
+
+    nsCOMPtr<nsIDOMWindow> win = aWindow;
     nsCOMPtr<nsIDOMElement> elem;
-    NS_ENSURE_SUCCESS(utils->ElementFromPoint(aX, aY, true, true, getter_AddRefs(elem)), );
+    while (win) {
+        nsCOMPtr<nsIDOMWindowUtils> utils = do_GetInterface(win);
+        if (!utils || NS_FAILED(utils->ElementFromPoint(aX, aY, true, true, getter_AddRefs(elem)))) {
+            elem = nullptr;
+            break;
+        }
 
-    nsCOMPtr<nsIDOMHTMLIFrameElement> elAsIFrame = do_QueryInterface(elem);
-    nsCOMPtr<nsIDOMHTMLFrameElement> elAsFrame = do_QueryInterface(elem);
-    while (elem && (elAsIFrame || elAsFrame)) {
+        nsCOMPtr<nsIDOMWindow> inner;
+        if (!elem || !GetFrameWindow(elem, getter_AddRefs(inner))) {
+            break;
+        }
         nsCOMPtr<nsIDOMClientRect> rect;
         elem->GetBoundingClientRect(getter_AddRefs(rect));
         float left, top;
@@ -179,28 +350,20 @@ EmbedTouchListener::AnyElementFromPoint(nsIDOMWindow* aWindow, double aX, double
         rect->GetTop(&top);
         aX -= left;
         aY -= top;
-        nsCOMPtr<nsIDOMDocument> contentDocument;
-        if (!elAsIFrame || NS_FAILED(elAsIFrame->GetContentDocument(getter_AddRefs(contentDocument)))) {
-            if (!elAsFrame || NS_FAILED(elAsFrame->GetContentDocument(getter_AddRefs(contentDocument)))) {
-                break;
-            }
-        }
-        nsCOMPtr<nsIDOMWindow> newWin;
-        contentDocument->GetDefaultView(getter_AddRefs(newWin));
-        utils = do_GetInterface(newWin);
-        if (NS_FAILED(utils->ElementFromPoint(aX, aY, true, true, getter_AddRefs(elem)))) {
-            elem = nullptr;
-        } else {
-            elAsIFrame = do_QueryInterface(elem);
-            elAsFrame = do_QueryInterface(elem);
-        }
+        win = inner;
     }
     if (elem) {
         NS_ADDREF(*aElem = elem);
     }
     mService->LeaveSecureJSContext();
+}
 
-    return;
+static bool
+IsListItem(nsIDOMElement* aElement)
+{
+    nsCOMPtr<nsIDOMHTMLLIElement> liel = do_QueryInterface(aElement);
+    nsCOMPtr<nsIDOMHTMLLIElement> qoteel = do_QueryInterface(aElement);
+    return liel || qoteel;
 }
 
 bool
@@ -209,6 +372,16 @@ EmbedTouchListener::ShouldZoomToElement(nsIDOMElement* aElement)
     nsCOMPtr<nsIDOMNode> node = do_QueryInterface(aElement);
     NS_ENSURE_TRUE(node, false);
 
+    // Laid out elements carry their display type, no need for computed style
+    nsCOMPtr<nsIContent> content = do_QueryInterface(aElement);
+    nsIFrame* primaryFrame = content ? content->GetPrimaryFrame() : nullptr;
+    if (primaryFrame) {
+        if (primaryFrame->StyleDisplay()->mDisplay == NS_STYLE_DISPLAY_INLINE) {
+            return false;
+        }
+        return !IsListItem(aElement);
+    }
+
     nsCOMPtr<nsIDOMDocument> document;
     NS_ENSURE_SUCCESS(node->GetOwnerDocument(getter_AddRefs(document)), false);
 
@@ -224,53 +397,51 @@ EmbedTouchListener::ShouldZoomToElement(nsIDOMElement* aElement)
             return false;
         }
     }
-    nsCOMPtr<nsIDOMHTMLLIElement> liel = do_QueryInterface(aElement);
-    nsCOMPtr<nsIDOMHTMLLIElement> qoteel = do_QueryInterface(aElement);
-    if (liel || qoteel)
-        return false;
-
-    return true;
+    return !IsListItem(aElement);
 }
 
-/* Zoom to an element, optionally keeping a particular part of it
- * in view if it is really tall.
+/* Zoom target for an element at aRect in content coordinates. Returns
+ * false when the view should stay as it is, an empty aTarget zooms out.
  */
-void
-EmbedTouchListener::ZoomToElement(nsIDOMElement* aElement, int aClickY, bool aCanZoomOut, bool aCanZoomIn)
+bool
+EmbedTouchListener::GetZoomTarget(gfx::Rect aRect, const gfx::Rect& aViewport,
+                                  bool aCanZoomOut, bool aCanZoomIn, gfx::Rect& aTarget)
 {
     const int margin = 15;
-    gfx::Rect clrect = GetBoundingContentRect(aElement);
+    gfx::Rect clrect = aRect;
     clrect.x = std::max(float(0.0), clrect.x - margin);
     clrect.y = std::max(float(0.0), clrect.y - margin);
-    clrect.width = std::min(clrect.width + 2*margin, mCssCompositedRect.width);
-    clrect.height = std::min(clrect.height + 2*margin, mCssCompositedRect.height);
+    clrect.width = std::min(clrect.width + 2*margin, aViewport.width);
+    clrect.height = std::min(clrect.height + 2*margin, aViewport.height);
     float elementAspectRatio = clrect.width / clrect.height;
-    float viewportAspectRatio = mCssCompositedRect.width / mCssCompositedRect.height;
-    bool zoomed = false;
-    if (IsRectZoomedIn(clrect, mCssCompositedRect)) {
-        if (aCanZoomOut) {
-            mService->ZoomToRect(mTopWinid, 0, 0, 0, 0);
-        }
-        return;
+    float viewportAspectRatio = aViewport.width / aViewport.height;
+    if (IsRectZoomedIn(clrect, aViewport)) {
+        aTarget = gfx::Rect(0, 0, 0, 0);
+        return aCanZoomOut;
     }
     if (elementAspectRatio > viewportAspectRatio) {
-        if ((clrect.width < mCssCompositedRect.width && aCanZoomIn) ||
-            (clrect.width > mCssCompositedRect.width && aCanZoomOut) ) {
-            mService->ZoomToRect(mTopWinid, clrect.x, clrect.y, clrect.width, clrect.height);
-            zoomed = true;
+        if ((clrect.width < aViewport.width && aCanZoomIn) ||
+            (clrect.width > aViewport.width && aCanZoomOut) ) {
+            aTarget = clrect;
+            return true;
         }
     }
     else if (elementAspectRatio < viewportAspectRatio && viewportAspectRatio < 1) {
-        if ((clrect.height < mCssCompositedRect.height && aCanZoomIn) ||
-            (clrect.height > mCssCompositedRect.height && aCanZoomOut) ) {
-            mService->ZoomToRect(mTopWinid, clrect.x, clrect.y, clrect.width, clrect.height);
-            zoomed = true;
+        if ((clrect.height < aViewport.height && aCanZoomIn) ||
+            (clrect.height > aViewport.height && aCanZoomOut) ) {
+            aTarget = clrect;
+            return true;
         }
     }
 
-    if (!zoomed) {
-        mService->ZoomToRect(mTopWinid, clrect.x, clrect.y, mCssCompositedRect.width, mCssCompositedRect.height);
-    }
+    aTarget = gfx::Rect(clrect.x, clrect.y, aViewport.width, aViewport.height);
+    return true;
+}
+
+void
+EmbedTouchListener::SendZoomRect(const gfx::Rect& aTarget)
+{
+    mService->ZoomToRect(mTopWinid, aTarget.x, aTarget.y, aTarget.width, aTarget.height);
 }
 
 static bool HasFrameElement(nsIDOMDocument* aDocument, nsIDOMElement* *aFrameElement = nullptr)
@@ -324,6 +495,33 @@ static void GetParentFrame(nsIDOMWindow* aWindow, nsIDOMWindow** outWindow)
     }
 }
 
+/* Offset of the content of frame window aFrame in the client area of its
+ * parent: the frame element's client rect plus its border, taken from the
+ * element's frame rather than computed style.
+ */
+gfx::Point
+EmbedTouchListener::GetFrameOffset(nsIDOMWindow* aFrame)
+{
+    gfx::Point offset(0, 0);
+    nsCOMPtr<nsIDOMElement> frElement;
+    aFrame->GetFrameElement(getter_AddRefs(frElement));
+    NS_ENSURE_TRUE(frElement, offset);
+
+    nsCOMPtr<nsIDOMClientRect> gr;
+    frElement->GetBoundingClientRect(getter_AddRefs(gr));
+    NS_ENSURE_TRUE(gr, offset);
+    gr->GetLeft(&offset.x);
+    gr->GetTop(&offset.y);
+    nsCOMPtr<nsIContent> content = do_QueryInterface(frElement);
+    nsIFrame* primaryFrame = content ? content->GetPrimaryFrame() : nullptr;
+    if (primaryFrame) {
+        nsMargin border = primaryFrame->GetUsedBorder();
+        offset.x += nsPresContext::AppUnitsToFloatCSSPixels(border.left);
+        offset.y += nsPresContext::AppUnitsToFloatCSSPixels(border.top);
+    }
+    return offset;
+}
+
 gfx::Rect
 EmbedTouchListener::GetBoundingContentRect(nsIDOMElement* aElement)
 {
@@ -362,20 +560,9 @@ EmbedTouchListener::GetBoundingContentRect(nsIDOMElement* aElement)
     nsCOMPtr<nsIDOMWindow> defView;
     origDocument->GetDefaultView(getter_AddRefs(defView));
     for (nsCOMPtr<nsIDOMWindow> frame = defView; _HasFrameElement(frame) && frame != DOMWindow; GetParentFrame(frame, getter_AddRefs(frame))) {
-        nsCOMPtr<nsIDOMElement> frElement;
-        frame->GetFrameElement(getter_AddRefs(frElement));
-        nsCOMPtr<nsIDOMClientRect> gr;
-        frElement->GetBoundingClientRect(getter_AddRefs(gr));
-        float grleft, grtop;
-        gr->GetLeft(&grleft);
-        gr->GetTop(&grtop);
-        nsCOMPtr<nsIDOMCSSStyleDeclaration> bW;
-        frame->GetComputedStyle(frElement, NS_LITERAL_STRING(""), getter_AddRefs(bW));
-        nsString blw, btw;
-        bW->GetPropertyValue(NS_LITERAL_STRING("border-left-width"), blw);
-        bW->GetPropertyValue(NS_LITERAL_STRING("border-top-width"), btw);
-        scrollX += grleft + atoi(NS_ConvertUTF16toUTF8(blw).get());
-        scrollY += grtop + atoi(NS_ConvertUTF16toUTF8(btw).get());
+        gfx::Point offset = GetFrameOffset(frame);
+        scrollX += offset.x;
+        scrollY += offset.y;
     }
 
     float rleft = 0, rtop = 0, rwidth = 0, rheight = 0;
@@ -13,6 +13,7 @@
 #include "nsIEmbedAppService.h"
 #include "nsIDOMWindow.h"
 #include "gfxRect.h"
+#include "nsTArray.h"
 
 #define MOZ_DOMTitleChanged "DOMTitleChanged"
 #define MOZ_DOMContentLoaded "DOMContentLoaded"
@@ -45,12 +46,19 @@ private:
 
     void AnyElementFromPoint(nsIDOMWindow* aWindow, double aX, double aY, nsIDOMElement* *aElem);
     bool ShouldZoomToElement(nsIDOMElement* aElement);
-    void ZoomToElement(nsIDOMElement* aElement,
-                       int aClickY = -1,
-                       bool aCanZoomOut = true,
-                       bool aCanZoomIn = true);
+    void DoubleTapZoom(const mozilla::CSSPoint& aPoint, const mozilla::gfx::Rect& aViewport, bool aProvisional);
+    void RefineDoubleTap();
+    bool GetProvisionalZoom(const mozilla::CSSPoint& aPoint, mozilla::gfx::Rect& aTarget);
+    void RememberZoomRect(const mozilla::gfx::Rect& aRect);
+    bool GetZoomTarget(mozilla::gfx::Rect aRect,
+                       const mozilla::gfx::Rect& aViewport,
+                       bool aCanZoomOut,
+                       bool aCanZoomIn,
+                       mozilla::gfx::Rect& aTarget);
+    void SendZoomRect(const mozilla::gfx::Rect& aTarget);
     mozilla::gfx::Rect GetBoundingContentRect(nsIDOMElement* aElement);
     bool IsRectZoomedIn(mozilla::gfx::Rect aRect, mozilla::gfx::Rect aViewport);
+    mozilla::gfx::Point GetFrameOffset(nsIDOMWindow* aFrame);
 
     nsCOMPtr<nsIEmbedAppService> mService;
     bool mGotViewPortUpdate;
@@ -58,6 +66,18 @@ private:
     mozilla::gfx::Rect mCssCompositedRect;
     mozilla::gfx::Rect mCssPageRect;
     uint32_t mTopWinid;
+
+    // Content rects of recent double tap targets, valid while the top
+    // window's reflow count is mZoomRectsReflows
+    nsTArray<mozilla::gfx::Rect> mZoomRects;
+    uint64_t mZoomRectsReflows;
+    // Tap waiting for RefineDoubleTap(), the composited rect it was made
+    // in and the zoom already sent for it
+    bool mTapPending;
+    mozilla::CSSPoint mPendingTap;
+    mozilla::gfx::Rect mPendingViewport;
+    bool mHasProvisionalZoom;
+    mozilla::gfx::Rect mProvisionalZoom;
 };
 
 #endif /*EmbedTouchListener_H_*/
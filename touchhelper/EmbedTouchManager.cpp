@@ -30,7 +30,6 @@
 #include "nsIWebNavigation.h"
 
 EmbedTouchManager::EmbedTouchManager()
-  : mWindowCounter(0)
 {
 }
 
@@ -97,9 +96,11 @@ EmbedTouchManager::WindowCreated(nsIDOMWindow* aWin)
     NS_ENSURE_TRUE(pidomWindow, );
     nsCOMPtr<nsIDOMEventTarget> target = do_QueryInterface(pidomWindow->GetChromeEventHandler());
     NS_ENSURE_TRUE(target, );
-    nsCOMPtr<EmbedTouchListener> listener = new EmbedTouchListener(aWin);
-    mArray.AppendObject(listener);
-    mWindowCounter++;
+    if (mListeners.Contains(aWin)) {
+        return;
+    }
+    nsRefPtr<EmbedTouchListener> listener = new EmbedTouchListener(aWin);
+    mListeners.Put(aWin, listener);
     if (!mService) {
         mService = do_GetService("@mozilla.org/embedlite-app-service;1");
     }
@@ -113,24 +114,15 @@ void
 EmbedTouchManager::WindowDestroyed(nsIDOMWindow* aWin)
 {
     LOGT("WindowClosed: %p", aWin);
-    nsCOMPtr<nsPIDOMWindow> pidomWindow = do_GetInterface(aWin);
-    NS_ENSURE_TRUE(pidomWindow, );
-    nsCOMPtr<nsIDOMEventTarget> target = do_QueryInterface(pidomWindow->GetChromeEventHandler());
-    NS_ENSURE_TRUE(target, );
-    nsCOMPtr<EmbedTouchListener> listener;
-    int i = 0;
-    for (i = 0; i < mArray.Count(); ++i) {
-        if (mArray[i]->DOMWindow.get() == aWin) {
-            listener = mArray[i];
-            break;
-        }
+    nsRefPtr<EmbedTouchListener> listener;
+    if (!mListeners.Get(aWin, getter_AddRefs(listener))) {
+        return;
     }
-    mArray.RemoveObjectAt(i);
-    mWindowCounter--;
+    mListeners.Remove(aWin);
     uint32_t id = 0;
     mService->GetIDByWindow(aWin, &id);
     mService->RemoveContentListener(id, listener);
-    if (!mWindowCounter) {
+    if (!mListeners.Count()) {
         mService = nullptr;
     }
 }
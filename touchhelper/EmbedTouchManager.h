@@ -12,7 +12,8 @@
 #include "nsIDOMEventListener.h"
 #include "nsIEmbedAppService.h"
 #include "EmbedTouchListener.h"
-#include "nsCOMArray.h"
+#include "nsRefPtrHashtable.h"
+#include "nsHashKeys.h"
 
 class EmbedTouchManager : public nsIObserver,
                           public nsSupportsWeakReference
@@ -29,9 +30,8 @@ private:
     void WindowCreated(nsIDOMWindow* aWin);
     void WindowDestroyed(nsIDOMWindow* aWin);
     nsCOMPtr<nsIEmbedAppService> mService;
-    int mWindowCounter;
-    typedef nsCOMArray<EmbedTouchListener> ObserversArray;
-    ObserversArray mArray;
+    typedef nsRefPtrHashtable<nsPtrHashKey<nsIDOMWindow>, EmbedTouchListener> ListenersTable;
+    ListenersTable mListeners;
 };
 
 #define NS_EMBED_TOUCH_CONTRACTID "@mozilla.org/embed-touch-component;1"